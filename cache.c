@@ -0,0 +1,870 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2023 MNX Cloud, Inc.
+ */
+
+/*
+ * In-daemon cache of Portolan answers, so a mapping the kernel aged out
+ * (but Portolan hasn't changed) costs no round trip.
+ *
+ * Three fixed-size, open-addressed (linear probing) tables:
+ *
+ *	VL3, IPv4:	(vnetid, IPv4) -> overlay MAC	24-byte entries
+ *	VL3, IPv6:	(vnetid, IPv6) -> overlay MAC	36-byte entries
+ *	VL2:		(vnetid, MAC) -> underlay IP/port	40-byte entries
+ *
+ * IPv4 gets its own table with an 8-byte key because nearly all fabric
+ * traffic is IPv4, and v4-mapped keys would more than double the entry.
+ * Each entry is a small metadata header, the key, then the value, all
+ * inline, so a probe touches one cache line in the common case.
+ *
+ * Each table is sized at twice its entry cap.  When a table is full, a
+ * CLOCK hand sweeps it, evicting expired entries outright and giving
+ * recently-hit entries a second chance.  Deletes use backward-shift so
+ * there are no tombstones.
+ *
+ * Two more tables of the same kind shadow what link.c has told the kernel,
+ * so it can skip writes that wouldn't change anything:
+ *
+ *	FDB:		(vxlan ifindex, MAC, VLAN) -> underlay IP/port
+ *	Neighbor:	(fabric ifindex, IP) -> overlay MAC
+ *
+ * A shadow entry only claims the kernel *probably* has that state.  It
+ * lapses after the same TTL, so everything is rewritten now and then, and
+ * link.c drops it on any sign otherwise (a solicitation, an RTM_DELNEIGH,
+ * a failed write).  Each also carries the reconciliation epoch it was last
+ * written or seen in a kernel dump; see sweep_shadow().
+ */
+
+#include <err.h>
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "svp.h"
+#include "cache.h"
+#include "timer.h"
+
+typedef struct cache_meta {
+	uint32_t cm_expire;	/* In cache_now() units; 0 == empty slot. */
+	uint8_t cm_ref;		/* CLOCK reference bit. */
+	uint8_t cm_pad[3];
+} cache_meta_t;
+
+typedef struct vl3v4_ent {
+	cache_meta_t c4_meta;
+	uint32_t c4_vnetid;		/* Key... */
+	uint32_t c4_ip;			/* ...ends here. */
+	uint8_t c4_mac[ETHERADDRL];
+	uint8_t c4_pad[2];
+} vl3v4_ent_t;
+
+typedef struct vl3v6_ent {
+	cache_meta_t c6_meta;
+	uint32_t c6_vnetid;		/* Key... */
+	uint8_t c6_ip[16];		/* ...ends here. */
+	uint8_t c6_mac[ETHERADDRL];
+	uint8_t c6_pad[2];
+} vl3v6_ent_t;
+
+typedef struct vl2_ent {
+	cache_meta_t c2_meta;
+	uint32_t c2_vnetid;		/* Key... */
+	uint8_t c2_mac[ETHERADDRL];
+	uint8_t c2_pad[2];		/* ...ends here. */
+	uint8_t c2_uip[16];
+	uint16_t c2_uport;
+	uint8_t c2_pad2[2];
+} vl2_ent_t;
+
+typedef struct fdb_shadow_ent {
+	cache_meta_t fs_meta;
+	int32_t fs_ifindex;		/* Key... */
+	uint8_t fs_mac[ETHERADDRL];
+	uint16_t fs_vid;		/* ...ends here. */
+	uint8_t fs_uip[16];
+	uint16_t fs_uport;
+	uint16_t fs_epoch;
+} fdb_shadow_ent_t;
+
+typedef struct neigh_shadow_ent {
+	cache_meta_t ns_meta;
+	int32_t ns_ifindex;		/* Key... */
+	uint8_t ns_ip[16];		/* ...ends here. */
+	uint8_t ns_mac[ETHERADDRL];
+	uint16_t ns_epoch;
+} neigh_shadow_ent_t;
+
+typedef struct cache_tab {
+	const char *ct_name;
+	uint8_t *ct_ents;
+	uint32_t ct_esize;	/* Entry size */
+	uint32_t ct_ksize;	/* Key size, key follows the cache_meta_t */
+	uint32_t ct_mask, ct_shift;
+	uint32_t ct_count, ct_max;
+	uint32_t ct_hand;	/* CLOCK hand */
+	uint64_t ct_hits, ct_misses, ct_inserts, ct_evictions, ct_expired;
+	uint64_t ct_stale_hits;
+} cache_tab_t;
+
+#define	CT_ENT(ct, i)	\
+	((cache_meta_t *)((ct)->ct_ents + (size_t)(i) * (ct)->ct_esize))
+#define	CT_KEY(cm)	((uint8_t *)(cm) + sizeof (cache_meta_t))
+
+static cache_tab_t vl3v4_tab = {
+	.ct_name = "VL3 IPv4",
+	.ct_esize = sizeof (vl3v4_ent_t),
+	.ct_ksize = 2 * sizeof (uint32_t),
+};
+static cache_tab_t vl3v6_tab = {
+	.ct_name = "VL3 IPv6",
+	.ct_esize = sizeof (vl3v6_ent_t),
+	.ct_ksize = sizeof (uint32_t) + 16,
+};
+static cache_tab_t vl2_tab = {
+	.ct_name = "VL2",
+	.ct_esize = sizeof (vl2_ent_t),
+	.ct_ksize = sizeof (uint32_t) + ETHERADDRL + 2,
+};
+
+static cache_tab_t fdb_shadow_tab = {
+	.ct_name = "FDB shadow",
+	.ct_esize = sizeof (fdb_shadow_ent_t),
+	.ct_ksize = sizeof (int32_t) + ETHERADDRL + sizeof (uint16_t),
+};
+static cache_tab_t neigh_shadow_tab = {
+	.ct_name = "Neighbor shadow",
+	.ct_esize = sizeof (neigh_shadow_ent_t),
+	.ct_ksize = sizeof (int32_t) + 16,
+};
+
+static uint32_t cache_ttl;	/* Seconds */
+static uint16_t shadow_epoch = 1;
+
+/*
+ * Negative cache, for SVP_S_NOTFOUND answers.  This one has to absorb a
+ * scanner walking a whole subnet, so rather than storing keys it's a
+ * set-associative table of 32-bit slots, four to a 16-byte bucket.  Each
+ * slot is a 16-bit fingerprint of the svp_lookup_key_t plus a 16-bit
+ * expiry time in seconds (compared modulo 2^16, so TTLs must be well under
+ * 9 hours).  A zero slot is empty.
+ *
+ * A fingerprint collision can suppress a real lookup, with a probability
+ * of about NEG_WAYS / 2^16 per lookup, and then only for one short TTL.
+ * The kernel will just solicit again.
+ */
+#define	NEG_WAYS	4
+#define	NEG_FP(slot)	((uint16_t)((slot) >> 16))
+#define	NEG_EXP(slot)	((uint16_t)(slot))
+
+static uint32_t (*neg_tab)[NEG_WAYS];
+static uint32_t neg_mask;	/* Bucket count - 1 */
+static uint32_t neg_ttl;	/* Seconds */
+static uint64_t neg_hits, neg_misses, neg_inserts, neg_displaced;
+
+/* Seconds, never 0 so 0 can mean "empty slot". */
+static uint32_t
+cache_now(void)
+{
+	return ((uint32_t)(now_ms() / 1000) + 1);
+}
+
+static void
+init_tab(cache_tab_t *ct, uint32_t max)
+{
+	uint32_t size = 2, bits = 1;
+
+	while (size < max * 2 && bits < 31) {
+		size <<= 1;
+		bits++;
+	}
+	ct->ct_ents = calloc(size, ct->ct_esize);
+	if (ct->ct_ents == NULL)
+		errx(-60, "init_cache(): can't allocate %s table", ct->ct_name);
+	ct->ct_mask = size - 1;
+	ct->ct_shift = 32 - bits;
+	ct->ct_max = max;
+}
+
+void
+init_cache(uint32_t max, uint32_t ttl)
+{
+	if (max == 0 || ttl == 0)
+		errx(-60, "init_cache(): size and TTL must be nonzero");
+
+	init_tab(&vl3v4_tab, max);
+	init_tab(&vl3v6_tab, max);
+	init_tab(&vl2_tab, max);
+	init_tab(&fdb_shadow_tab, max);
+	init_tab(&neigh_shadow_tab, max);
+	cache_ttl = ttl;
+}
+
+void
+init_negative_cache(uint32_t entries, uint32_t ttl)
+{
+	uint32_t buckets = 1;
+
+	if (entries == 0 || ttl == 0 || ttl > 3600)
+		errx(-61, "init_negative_cache(): bad size or TTL");
+
+	while (buckets * NEG_WAYS < entries && buckets < (1U << 28))
+		buckets <<= 1;
+	neg_tab = calloc(buckets, sizeof (*neg_tab));
+	if (neg_tab == NULL)
+		errx(-61, "init_negative_cache(): allocation failed");
+	neg_mask = buckets - 1;
+	neg_ttl = ttl;
+}
+
+/* Bucket in the low half, non-zero fingerprint in the high half. */
+static uint64_t
+neg_hash(const svp_lookup_key_t *key)
+{
+	uint64_t w[3], h;
+
+	memcpy(w, key, sizeof (w));
+	h = w[0] ^ (w[1] * 0x9E3779B97F4A7C15ULL) ^
+	    (w[2] * 0xC2B2AE3D27D4EB4FULL);
+	/* splitmix64 finalizer, so both ends of the word are well mixed. */
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+	h ^= h >> 31;
+	if ((h >> 48) == 0)
+		h |= 1ULL << 48;
+	return (h);
+}
+
+static inline bool
+neg_live(uint32_t slot, uint16_t now)
+{
+	/* Live if its expiry is in the (modular) future. */
+	return (slot != 0 && (int16_t)(NEG_EXP(slot) - now) > 0);
+}
+
+bool
+find_negative(const svp_lookup_key_t *key)
+{
+	uint64_t h;
+	uint32_t *bucket;
+	uint16_t now = (uint16_t)cache_now();
+	int i;
+
+	if (neg_tab == NULL)
+		return (false);
+	h = neg_hash(key);
+	bucket = neg_tab[h & neg_mask];
+	for (i = 0; i < NEG_WAYS; i++) {
+		if (NEG_FP(bucket[i]) == (uint16_t)(h >> 48) &&
+		    neg_live(bucket[i], now)) {
+			neg_hits++;
+			return (true);
+		}
+	}
+	neg_misses++;
+	return (false);
+}
+
+/* Remember "key" as nonexistent for "ttl" seconds, or if 0, the default. */
+void
+insert_negative(const svp_lookup_key_t *key, uint32_t ttl)
+{
+	uint64_t h;
+	uint32_t *bucket, *victim = NULL;
+	uint16_t now = (uint16_t)cache_now(), fp;
+	int i;
+
+	if (neg_tab == NULL)
+		return;
+	h = neg_hash(key);
+	fp = (uint16_t)(h >> 48);
+	bucket = neg_tab[h & neg_mask];
+	for (i = 0; i < NEG_WAYS; i++) {
+		if (NEG_FP(bucket[i]) == fp || !neg_live(bucket[i], now)) {
+			victim = &bucket[i];
+			break;
+		}
+		/* Otherwise displace whichever expires soonest. */
+		if (victim == NULL || (int16_t)(NEG_EXP(bucket[i]) -
+		    NEG_EXP(*victim)) < 0)
+			victim = &bucket[i];
+	}
+	if (i == NEG_WAYS)
+		neg_displaced++;
+	neg_inserts++;
+	*victim = ((uint32_t)fp << 16) |
+	    (uint16_t)(now + (ttl != 0 ? ttl : neg_ttl));
+}
+
+void
+remove_negative(const svp_lookup_key_t *key)
+{
+	uint64_t h;
+	uint32_t *bucket;
+	int i;
+
+	if (neg_tab == NULL)
+		return;
+	h = neg_hash(key);
+	bucket = neg_tab[h & neg_mask];
+	for (i = 0; i < NEG_WAYS; i++) {
+		if (NEG_FP(bucket[i]) == (uint16_t)(h >> 48))
+			bucket[i] = 0;
+	}
+}
+
+/* Keys are always a multiple of 4 bytes. */
+static uint32_t
+ct_slot(const cache_tab_t *ct, const uint8_t *key)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ULL;
+	uint32_t w, i;
+
+	for (i = 0; i < ct->ct_ksize; i += sizeof (w)) {
+		memcpy(&w, key + i, sizeof (w));
+		h = (h ^ w) * 0xBF58476D1CE4E5B9ULL;
+		h ^= h >> 31;
+	}
+	return ((uint32_t)(h >> 32) >> ct->ct_shift);
+}
+
+static void
+ct_delete(cache_tab_t *ct, uint32_t slot)
+{
+	uint32_t next, home;
+	cache_meta_t *cm;
+
+	for (next = (slot + 1) & ct->ct_mask;
+	    (cm = CT_ENT(ct, next))->cm_expire != 0;
+	    next = (next + 1) & ct->ct_mask) {
+		home = ct_slot(ct, CT_KEY(cm));
+		if (((next - home) & ct->ct_mask) >=
+		    ((next - slot) & ct->ct_mask)) {
+			memcpy(CT_ENT(ct, slot), cm, ct->ct_esize);
+			slot = next;
+		}
+	}
+	memset(CT_ENT(ct, slot), 0, ct->ct_esize);
+	ct->ct_count--;
+}
+
+/* Returns the slot holding "key", or -1. */
+static int64_t
+ct_probe(const cache_tab_t *ct, const uint8_t *key)
+{
+	uint32_t slot;
+	cache_meta_t *cm;
+
+	if (ct->ct_ents == NULL)
+		return (-1);
+	for (slot = ct_slot(ct, key); (cm = CT_ENT(ct, slot))->cm_expire != 0;
+	    slot = (slot + 1) & ct->ct_mask) {
+		if (memcmp(CT_KEY(cm), key, ct->ct_ksize) == 0)
+			return (slot);
+	}
+	return (-1);
+}
+
+/*
+ * With "stale_ok", an expired entry is still returned (and kept) so the
+ * caller can use it while it revalidates.  Expired entries are the first
+ * thing the CLOCK hand evicts, so they don't linger on a busy table.
+ */
+static cache_meta_t *
+ct_find(cache_tab_t *ct, const uint8_t *key, bool stale_ok)
+{
+	int64_t slot = ct_probe(ct, key);
+	cache_meta_t *cm;
+
+	if (slot == -1) {
+		ct->ct_misses++;
+		return (NULL);
+	}
+	cm = CT_ENT(ct, slot);
+	if (cm->cm_expire <= cache_now()) {
+		if (stale_ok) {
+			cm->cm_ref = 1;
+			ct->ct_stale_hits++;
+			return (cm);
+		}
+		ct->ct_expired++;
+		ct->ct_misses++;
+		ct_delete(ct, slot);
+		return (NULL);
+	}
+	cm->cm_ref = 1;
+	ct->ct_hits++;
+	return (cm);
+}
+
+/* Make room for one more entry.  Only called on a full table. */
+static void
+ct_evict(cache_tab_t *ct)
+{
+	uint32_t now = cache_now();
+	cache_meta_t *cm;
+
+	assert(ct->ct_count > 0);
+	for (;;) {
+		ct->ct_hand = (ct->ct_hand + 1) & ct->ct_mask;
+		cm = CT_ENT(ct, ct->ct_hand);
+		if (cm->cm_expire == 0)
+			continue;
+		if (cm->cm_expire <= now) {
+			ct->ct_expired++;
+			break;
+		}
+		if (cm->cm_ref != 0) {
+			cm->cm_ref = 0;	/* Second chance. */
+			continue;
+		}
+		ct->ct_evictions++;
+		break;
+	}
+	ct_delete(ct, ct->ct_hand);
+}
+
+/* Returns the (new or existing) entry for "key" with a fresh TTL. */
+static cache_meta_t *
+ct_insert(cache_tab_t *ct, const uint8_t *key)
+{
+	int64_t found = ct_probe(ct, key);
+	uint32_t slot;
+	cache_meta_t *cm;
+
+	if (found == -1) {
+		if (ct->ct_count >= ct->ct_max)
+			ct_evict(ct);
+		for (slot = ct_slot(ct, key);
+		    CT_ENT(ct, slot)->cm_expire != 0;
+		    slot = (slot + 1) & ct->ct_mask)
+			;
+		cm = CT_ENT(ct, slot);
+		memcpy(CT_KEY(cm), key, ct->ct_ksize);
+		ct->ct_count++;
+	} else {
+		cm = CT_ENT(ct, found);
+	}
+	ct->ct_inserts++;
+	cm->cm_expire = cache_now() + cache_ttl;
+	return (cm);
+}
+
+static void
+ct_remove(cache_tab_t *ct, const uint8_t *key)
+{
+	int64_t slot = ct_probe(ct, key);
+
+	if (slot != -1)
+		ct_delete(ct, slot);
+}
+
+/*
+ * Fill in a VL3 key of the right flavor.  Returns the table to use; "key"
+ * must have room for the larger (IPv6) key.
+ */
+static cache_tab_t *
+vl3_key(uint32_t vnetid, const uint8_t *ip, uint8_t *key)
+{
+	memcpy(key, &vnetid, sizeof (vnetid));
+	if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)ip)) {
+		memcpy(key + sizeof (vnetid), ip + 12, sizeof (uint32_t));
+		return (&vl3v4_tab);
+	}
+	memcpy(key + sizeof (vnetid), ip, 16);
+	return (&vl3v6_tab);
+}
+
+static void
+vl2_key(uint32_t vnetid, const uint8_t *mac, uint8_t *key)
+{
+	memcpy(key, &vnetid, sizeof (vnetid));
+	memcpy(key + sizeof (vnetid), mac, ETHERADDRL);
+	key[sizeof (vnetid) + ETHERADDRL] = 0;
+	key[sizeof (vnetid) + ETHERADDRL + 1] = 0;
+}
+
+/* The MAC lives at the same offset in both VL3 entry types. */
+#define	VL3_MAC(ct, cm)	(((ct) == &vl3v4_tab) ? \
+	((vl3v4_ent_t *)(cm))->c4_mac : ((vl3v6_ent_t *)(cm))->c6_mac)
+
+bool
+find_vl3_mapping(uint32_t vnetid, const uint8_t *ip, uint8_t *mac,
+    bool stale_ok)
+{
+	uint8_t key[sizeof (uint32_t) + 16];
+	cache_tab_t *ct = vl3_key(vnetid, ip, key);
+	cache_meta_t *cm = ct_find(ct, key, stale_ok);
+
+	if (cm == NULL)
+		return (false);
+	memcpy(mac, VL3_MAC(ct, cm), ETHERADDRL);
+	return (true);
+}
+
+void
+insert_vl3_mapping(uint32_t vnetid, const uint8_t *ip, const uint8_t *mac)
+{
+	uint8_t key[sizeof (uint32_t) + 16];
+	cache_tab_t *ct = vl3_key(vnetid, ip, key);
+
+	if (ct->ct_ents == NULL)
+		return;
+	memcpy(VL3_MAC(ct, ct_insert(ct, key)), mac, ETHERADDRL);
+}
+
+void
+remove_vl3_mapping(uint32_t vnetid, const uint8_t *ip)
+{
+	uint8_t key[sizeof (uint32_t) + 16];
+	cache_tab_t *ct = vl3_key(vnetid, ip, key);
+
+	ct_remove(ct, key);
+}
+
+bool
+find_vl2_mapping(uint32_t vnetid, const uint8_t *mac, uint8_t *uip,
+    uint16_t *uport, bool stale_ok)
+{
+	uint8_t key[sizeof (uint32_t) + ETHERADDRL + 2];
+	vl2_ent_t *ent;
+
+	vl2_key(vnetid, mac, key);
+	ent = (vl2_ent_t *)ct_find(&vl2_tab, key, stale_ok);
+	if (ent == NULL)
+		return (false);
+	memcpy(uip, ent->c2_uip, sizeof (ent->c2_uip));
+	*uport = ent->c2_uport;
+	return (true);
+}
+
+void
+insert_vl2_mapping(uint32_t vnetid, const uint8_t *mac, const uint8_t *uip,
+    uint16_t uport)
+{
+	uint8_t key[sizeof (uint32_t) + ETHERADDRL + 2];
+	vl2_ent_t *ent;
+
+	if (vl2_tab.ct_ents == NULL)
+		return;
+	vl2_key(vnetid, mac, key);
+	ent = (vl2_ent_t *)ct_insert(&vl2_tab, key);
+	memcpy(ent->c2_uip, uip, sizeof (ent->c2_uip));
+	ent->c2_uport = uport;
+}
+
+void
+remove_vl2_mapping(uint32_t vnetid, const uint8_t *mac)
+{
+	uint8_t key[sizeof (uint32_t) + ETHERADDRL + 2];
+
+	vl2_key(vnetid, mac, key);
+	ct_remove(&vl2_tab, key);
+}
+
+/*
+ * Like find_vl3_mapping(), but with no side effects: no CLOCK reference,
+ * no hit or miss counted, and an expired entry is left for the CLOCK hand
+ * (though still not returned), so a reconciliation pass over the whole
+ * kernel table doesn't look like traffic.
+ */
+static int64_t
+ct_peek(const cache_tab_t *ct, const uint8_t *key)
+{
+	int64_t slot = ct_probe(ct, key);
+
+	if (slot == -1 || CT_ENT(ct, slot)->cm_expire <= cache_now())
+		return (-1);
+	return (slot);
+}
+
+bool
+peek_vl3_mapping(uint32_t vnetid, const uint8_t *ip, uint8_t *mac)
+{
+	uint8_t key[sizeof (uint32_t) + 16];
+	cache_tab_t *ct = vl3_key(vnetid, ip, key);
+	int64_t slot = ct_peek(ct, key);
+
+	if (slot == -1)
+		return (false);
+	memcpy(mac, VL3_MAC(ct, CT_ENT(ct, slot)), ETHERADDRL);
+	return (true);
+}
+
+bool
+peek_vl2_mapping(uint32_t vnetid, const uint8_t *mac, uint8_t *uip,
+    uint16_t *uport)
+{
+	uint8_t key[sizeof (uint32_t) + ETHERADDRL + 2];
+	vl2_ent_t *ent;
+	int64_t slot;
+
+	vl2_key(vnetid, mac, key);
+	if ((slot = ct_peek(&vl2_tab, key)) == -1)
+		return (false);
+	ent = (vl2_ent_t *)CT_ENT(&vl2_tab, slot);
+	memcpy(uip, ent->c2_uip, sizeof (ent->c2_uip));
+	*uport = ent->c2_uport;
+	return (true);
+}
+
+static void
+fdb_shadow_key(int32_t ifindex, const uint8_t *mac, uint16_t vid,
+    uint8_t *key)
+{
+	memcpy(key, &ifindex, sizeof (ifindex));
+	memcpy(key + sizeof (ifindex), mac, ETHERADDRL);
+	memcpy(key + sizeof (ifindex) + ETHERADDRL, &vid, sizeof (vid));
+}
+
+static void
+neigh_shadow_key(int32_t ifindex, const uint8_t *ip, uint8_t *key)
+{
+	memcpy(key, &ifindex, sizeof (ifindex));
+	memcpy(key + sizeof (ifindex), ip, 16);
+}
+
+/*
+ * About to point "mac", VLAN "vid", on vxlan "ifindex" at "uip"/"uport".
+ * Returns false if the kernel should already have exactly that, so the
+ * write can be skipped; otherwise remembers it and returns true.
+ */
+bool
+update_fdb_shadow(int32_t ifindex, const uint8_t *mac, uint16_t vid,
+    const uint8_t *uip, uint16_t uport)
+{
+	uint8_t key[sizeof (int32_t) + ETHERADDRL + sizeof (uint16_t)];
+	fdb_shadow_ent_t *ent;
+
+	if (fdb_shadow_tab.ct_ents == NULL)
+		return (true);
+	fdb_shadow_key(ifindex, mac, vid, key);
+	ent = (fdb_shadow_ent_t *)ct_find(&fdb_shadow_tab, key, false);
+	if (ent != NULL && ent->fs_uport == uport &&
+	    memcmp(ent->fs_uip, uip, sizeof (ent->fs_uip)) == 0)
+		return (false);
+	ent = (fdb_shadow_ent_t *)ct_insert(&fdb_shadow_tab, key);
+	memcpy(ent->fs_uip, uip, sizeof (ent->fs_uip));
+	ent->fs_uport = uport;
+	ent->fs_epoch = shadow_epoch;
+	return (true);
+}
+
+/* As update_fdb_shadow(), for "ip" -> "mac" on fabric link "ifindex". */
+bool
+update_neigh_shadow(int32_t ifindex, const uint8_t *ip, const uint8_t *mac)
+{
+	uint8_t key[sizeof (int32_t) + 16];
+	neigh_shadow_ent_t *ent;
+
+	if (neigh_shadow_tab.ct_ents == NULL)
+		return (true);
+	neigh_shadow_key(ifindex, ip, key);
+	ent = (neigh_shadow_ent_t *)ct_find(&neigh_shadow_tab, key, false);
+	if (ent != NULL && memcmp(ent->ns_mac, mac, ETHERADDRL) == 0)
+		return (false);
+	ent = (neigh_shadow_ent_t *)ct_insert(&neigh_shadow_tab, key);
+	memcpy(ent->ns_mac, mac, ETHERADDRL);
+	ent->ns_epoch = shadow_epoch;
+	return (true);
+}
+
+/* Whether we've pointed "mac", VLAN "vid", on vxlan "ifindex" anywhere. */
+bool
+find_fdb_shadow(int32_t ifindex, const uint8_t *mac, uint16_t vid)
+{
+	uint8_t key[sizeof (int32_t) + ETHERADDRL + sizeof (uint16_t)];
+
+	fdb_shadow_key(ifindex, mac, vid, key);
+	return (ct_find(&fdb_shadow_tab, key, false) != NULL);
+}
+
+/* What we last resolved "ip" on fabric link "ifindex" to, if anything. */
+bool
+find_neigh_shadow(int32_t ifindex, const uint8_t *ip, uint8_t *mac)
+{
+	uint8_t key[sizeof (int32_t) + 16];
+	neigh_shadow_ent_t *ent;
+
+	neigh_shadow_key(ifindex, ip, key);
+	ent = (neigh_shadow_ent_t *)ct_find(&neigh_shadow_tab, key, false);
+	if (ent == NULL)
+		return (false);
+	memcpy(mac, ent->ns_mac, ETHERADDRL);
+	return (true);
+}
+
+void
+remove_fdb_shadow(int32_t ifindex, const uint8_t *mac, uint16_t vid)
+{
+	uint8_t key[sizeof (int32_t) + ETHERADDRL + sizeof (uint16_t)];
+
+	fdb_shadow_key(ifindex, mac, vid, key);
+	ct_remove(&fdb_shadow_tab, key);
+}
+
+void
+remove_neigh_shadow(int32_t ifindex, const uint8_t *ip)
+{
+	uint8_t key[sizeof (int32_t) + 16];
+
+	neigh_shadow_key(ifindex, ip, key);
+	ct_remove(&neigh_shadow_tab, key);
+}
+
+/* Start a reconciliation pass; see sweep_shadow(). */
+void
+new_shadow_epoch(void)
+{
+	if (++shadow_epoch == 0)
+		shadow_epoch = 1;
+}
+
+/*
+ * A kernel dump shows "mac", VLAN "vid", on vxlan "ifindex" pointing at
+ * "uip"/"uport".  If the shadow agrees, it's current for this epoch; if it
+ * doesn't, it was wrong, so forget it.
+ */
+void
+mark_fdb_shadow(int32_t ifindex, const uint8_t *mac, uint16_t vid,
+    const uint8_t *uip, uint16_t uport)
+{
+	uint8_t key[sizeof (int32_t) + ETHERADDRL + sizeof (uint16_t)];
+	fdb_shadow_ent_t *ent;
+	int64_t slot;
+
+	fdb_shadow_key(ifindex, mac, vid, key);
+	if ((slot = ct_probe(&fdb_shadow_tab, key)) == -1)
+		return;
+	ent = (fdb_shadow_ent_t *)CT_ENT(&fdb_shadow_tab, slot);
+	if (ent->fs_uport == uport &&
+	    memcmp(ent->fs_uip, uip, sizeof (ent->fs_uip)) == 0)
+		ent->fs_epoch = shadow_epoch;
+	else
+		ct_delete(&fdb_shadow_tab, slot);
+}
+
+/* As mark_fdb_shadow(), for "ip" -> "mac" on fabric link "ifindex". */
+void
+mark_neigh_shadow(int32_t ifindex, const uint8_t *ip, const uint8_t *mac)
+{
+	uint8_t key[sizeof (int32_t) + 16];
+	neigh_shadow_ent_t *ent;
+	int64_t slot;
+
+	neigh_shadow_key(ifindex, ip, key);
+	if ((slot = ct_probe(&neigh_shadow_tab, key)) == -1)
+		return;
+	ent = (neigh_shadow_ent_t *)CT_ENT(&neigh_shadow_tab, slot);
+	if (memcmp(ent->ns_mac, mac, ETHERADDRL) == 0)
+		ent->ns_epoch = shadow_epoch;
+	else
+		ct_delete(&neigh_shadow_tab, slot);
+}
+
+static uint32_t
+sweep_tab(cache_tab_t *ct, size_t epoch_off, bool (*dumped)(int32_t))
+{
+	cache_meta_t *cm;
+	uint32_t slot, swept = 0, now = cache_now();
+	uint16_t epoch;
+	int32_t ifindex;
+
+	if (ct->ct_ents == NULL)
+		return (0);
+	for (slot = 0; slot <= ct->ct_mask; slot++) {
+		while ((cm = CT_ENT(ct, slot))->cm_expire != 0) {
+			memcpy(&epoch, (uint8_t *)cm + epoch_off,
+			    sizeof (epoch));
+			memcpy(&ifindex, CT_KEY(cm), sizeof (ifindex));
+			if (cm->cm_expire <= now) {
+				/* Lapsed anyway; says nothing of the kernel. */
+				ct->ct_expired++;
+			} else if (epoch == shadow_epoch || !dumped(ifindex)) {
+				break;
+			} else {
+				swept++;
+			}
+			ct_delete(ct, slot);
+		}
+	}
+	return (swept);
+}
+
+/*
+ * End a reconciliation pass.  Every shadow entry on a link that "dumped"
+ * says was fully dumped, but that wasn't marked or written since
+ * new_shadow_epoch(), isn't in the kernel any more; forget it, so it gets
+ * written again next time rather than elided.  Returns how many went.
+ */
+uint32_t
+sweep_shadow(bool (*dumped)(int32_t))
+{
+	return (sweep_tab(&fdb_shadow_tab, offsetof(fdb_shadow_ent_t,
+	    fs_epoch), dumped) + sweep_tab(&neigh_shadow_tab,
+	    offsetof(neigh_shadow_ent_t, ns_epoch), dumped));
+}
+
+/*
+ * Drop every entry for "ifindex" from a shadow table.  A backward shift
+ * can wrap an entry past the sweep, so sweep until one finds nothing.
+ * Links come and go rarely.
+ */
+static void
+purge_tab(cache_tab_t *ct, int32_t ifindex)
+{
+	cache_meta_t *cm;
+	uint32_t slot;
+	bool again;
+
+	if (ct->ct_ents == NULL)
+		return;
+	do {
+		again = false;
+		for (slot = 0; slot <= ct->ct_mask; slot++) {
+			while ((cm = CT_ENT(ct, slot))->cm_expire != 0 &&
+			    memcmp(CT_KEY(cm), &ifindex, sizeof (ifindex)) ==
+			    0) {
+				ct_delete(ct, slot);
+				again = true;
+			}
+		}
+	} while (again);
+}
+
+/* Link "ifindex" is gone, and its number may be reused. */
+void
+purge_shadow(int32_t ifindex)
+{
+	purge_tab(&fdb_shadow_tab, ifindex);
+	purge_tab(&neigh_shadow_tab, ifindex);
+}
+
+static void
+dump_tab(const cache_tab_t *ct)
+{
+	warnx("%s cache: %u/%u entries, %lu hits, %lu stale hits, %lu misses, "
+	    "%lu inserts, %lu evicted, %lu expired", ct->ct_name, ct->ct_count,
+	    ct->ct_max, ct->ct_hits, ct->ct_stale_hits, ct->ct_misses,
+	    ct->ct_inserts, ct->ct_evictions, ct->ct_expired);
+}
+
+void
+dump_cache_stats(void)
+{
+	dump_tab(&vl3v4_tab);
+	dump_tab(&vl3v6_tab);
+	dump_tab(&vl2_tab);
+	dump_tab(&fdb_shadow_tab);
+	dump_tab(&neigh_shadow_tab);
+	warnx("Negative cache: %u slots, %lu hits, %lu misses, %lu inserts, "
+	    "%lu displaced", (neg_mask + 1) * NEG_WAYS, neg_hits, neg_misses,
+	    neg_inserts, neg_displaced);
+}
@@ -0,0 +1,64 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2023 MNX Cloud, Inc.
+ */
+
+#ifndef _CACHE_H
+#define	_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "svp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Local cache of Portolan answers.  VL3 addresses are passed as 16-byte
+ * IPv6 (v4-mapped for IPv4), MACs as ETHERADDRL bytes, vnetids in host
+ * order, underlay ports in network order.
+ */
+extern void init_cache(uint32_t, uint32_t);
+extern bool find_vl3_mapping(uint32_t, const uint8_t *, uint8_t *, bool);
+extern bool find_vl2_mapping(uint32_t, const uint8_t *, uint8_t *,
+    uint16_t *, bool);
+extern void insert_vl3_mapping(uint32_t, const uint8_t *, const uint8_t *);
+extern void insert_vl2_mapping(uint32_t, const uint8_t *, const uint8_t *,
+    uint16_t);
+extern void remove_vl3_mapping(uint32_t, const uint8_t *);
+extern void remove_vl2_mapping(uint32_t, const uint8_t *);
+extern bool peek_vl3_mapping(uint32_t, const uint8_t *, uint8_t *);
+extern bool peek_vl2_mapping(uint32_t, const uint8_t *, uint8_t *,
+    uint16_t *);
+extern void init_negative_cache(uint32_t, uint32_t);
+extern bool find_negative(const svp_lookup_key_t *);
+extern void insert_negative(const svp_lookup_key_t *, uint32_t);
+extern void remove_negative(const svp_lookup_key_t *);
+/* Shadow of what's been written to the kernel; ifindexes, not vnetids. */
+extern bool update_fdb_shadow(int32_t, const uint8_t *, uint16_t,
+    const uint8_t *, uint16_t);
+extern bool update_neigh_shadow(int32_t, const uint8_t *, const uint8_t *);
+extern bool find_fdb_shadow(int32_t, const uint8_t *, uint16_t);
+extern bool find_neigh_shadow(int32_t, const uint8_t *, uint8_t *);
+extern void remove_fdb_shadow(int32_t, const uint8_t *, uint16_t);
+extern void remove_neigh_shadow(int32_t, const uint8_t *);
+extern void purge_shadow(int32_t);
+extern void new_shadow_epoch(void);
+extern void mark_fdb_shadow(int32_t, const uint8_t *, uint16_t,
+    const uint8_t *, uint16_t);
+extern void mark_neigh_shadow(int32_t, const uint8_t *, const uint8_t *);
+extern uint32_t sweep_shadow(bool (*)(int32_t));
+extern void dump_cache_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CACHE_H */
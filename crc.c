@@ -0,0 +1,243 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2023 MNX Cloud, Inc.
+ */
+
+/*
+ * CRC32 engines for SVP frames.  Every frame is checksummed on send and
+ * on receive, so this is worth more than the byte-at-a-time CRC32()
+ * macro.  There are three engines, all producing identical results:
+ *
+ *	table	The CRC32() macro over CRC32_TABLE.  The reference.
+ *	slice8	Slicing-by-8: eight derived tables, eight bytes per step.
+ *	pclmul	Carry-less multiply folding (Intel's "Fast CRC Computation
+ *		for Generic Polynomials Using PCLMULQDQ"), 64 bytes per
+ *		step, with slice8 for the head and tail.
+ *
+ * init_crc() picks the fastest one the CPU supports.  crc_test.c (`make
+ * check`) checks each engine against the reference.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "crc.h"
+#include "crc32.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define	CRC_PCLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef uint32_t (*crc_func_t)(uint32_t, const uint8_t *, size_t);
+
+static const uint32_t crc_table[256] = { CRC32_TABLE };
+static uint32_t crc_slice[8][256];
+
+static uint32_t
+crc_bytewise(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	CRC32(crc, buf, len, crc, crc_table);
+	return (crc);
+}
+
+static uint32_t
+crc_slice8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint32_t lo;
+
+	while (len >= 8) {
+		/* Assembled bytewise, so it works regardless of endianness. */
+		lo = crc ^ ((uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+		    (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24);
+		crc = crc_slice[7][lo & 0xff] ^
+		    crc_slice[6][(lo >> 8) & 0xff] ^
+		    crc_slice[5][(lo >> 16) & 0xff] ^
+		    crc_slice[4][lo >> 24] ^
+		    crc_slice[3][buf[4]] ^ crc_slice[2][buf[5]] ^
+		    crc_slice[1][buf[6]] ^ crc_slice[0][buf[7]];
+		buf += 8;
+		len -= 8;
+	}
+	return (crc_bytewise(crc, buf, len));
+}
+
+#ifdef CRC_PCLMUL
+/*
+ * Folding constants for the reflected CRC32_POLY, from the paper:
+ * k1/k2 fold 512 bits, k3/k4 fold 128, k5 folds 96 to 64, then a Barrett
+ * reduction with mu and P' gets us to 32.
+ */
+static const uint64_t crc_k1k2[2] __attribute__((aligned(16))) =
+	{ 0x0154442bd4ULL, 0x01c6e41596ULL };
+static const uint64_t crc_k3k4[2] __attribute__((aligned(16))) =
+	{ 0x01751997d0ULL, 0x00ccaa009eULL };
+static const uint64_t crc_k5k0[2] __attribute__((aligned(16))) =
+	{ 0x0163cd6124ULL, 0x0000000000ULL };
+static const uint64_t crc_mu[2] __attribute__((aligned(16))) =
+	{ 0x01db710641ULL, 0x01f7011641ULL };
+
+#define	CRC_PCLMUL_MIN	64
+
+/* One 128-bit fold of "x" by constants "k", xor'd into "y". */
+#define	CRC_FOLD(x, k, y)						\
+	_mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128((x), (k), 0x00), \
+	    _mm_clmulepi64_si128((x), (k), 0x11)), (y))
+
+/* "len" must be a multiple of 16, and at least CRC_PCLMUL_MIN. */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t
+crc_fold(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	__m128i k, x1, x2, x3, x4, mask;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	buf += 64;
+	len -= 64;
+
+	/* Four lanes, 64 bytes at a time. */
+	k = _mm_load_si128((const __m128i *)crc_k1k2);
+	while (len >= 64) {
+		x1 = CRC_FOLD(x1, k,
+		    _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+		x2 = CRC_FOLD(x2, k,
+		    _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+		x3 = CRC_FOLD(x3, k,
+		    _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+		x4 = CRC_FOLD(x4, k,
+		    _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Down to one lane, then 16 bytes at a time. */
+	k = _mm_load_si128((const __m128i *)crc_k3k4);
+	x1 = CRC_FOLD(x1, k, x2);
+	x1 = CRC_FOLD(x1, k, x3);
+	x1 = CRC_FOLD(x1, k, x4);
+	while (len >= 16) {
+		x1 = CRC_FOLD(x1, k, _mm_loadu_si128((const __m128i *)buf));
+		buf += 16;
+		len -= 16;
+	}
+
+	/* 128 -> 64 bits. */
+	mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	k = _mm_loadl_epi64((const __m128i *)crc_k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction, 64 -> 32 bits. */
+	k = _mm_load_si128((const __m128i *)crc_mu);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return ((uint32_t)_mm_extract_epi32(x1, 1));
+}
+
+static uint32_t
+crc_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	size_t bulk;
+
+	if (len >= CRC_PCLMUL_MIN) {
+		bulk = len & ~(size_t)15;
+		crc = crc_fold(crc, buf, bulk);
+		buf += bulk;
+		len -= bulk;
+	}
+	return (crc_slice8(crc, buf, len));
+}
+
+static bool
+cpu_has_pclmul(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return (false);
+	return ((ecx & bit_PCLMUL) != 0 && (ecx & bit_SSE4_1) != 0);
+}
+#endif	/* CRC_PCLMUL */
+
+static struct {
+	const char *ce_name;
+	crc_func_t ce_func;
+} crc_engines[] = {
+	{ "table", crc_bytewise },
+	{ "slice8", crc_slice8 },
+#ifdef CRC_PCLMUL
+	{ "pclmul", crc_pclmul },
+#endif
+};
+#define	CRC_NENGINES	(sizeof (crc_engines) / sizeof (crc_engines[0]))
+
+static uint32_t crc_engine;	/* Index into crc_engines[]. */
+static uint32_t crc_usable = 2;	/* Engines this CPU can run. */
+
+uint32_t
+crc32_buf(uint32_t crc, const void *buf, size_t len)
+{
+	return (crc_engines[crc_engine].ce_func(crc, buf, len));
+}
+
+const char *
+crc32_engine(void)
+{
+	return (crc_engines[crc_engine].ce_name);
+}
+
+/*
+ * Use engine "name" from now on, e.g. to test it.  Returns false if there's
+ * no such engine, or this CPU can't run it.
+ */
+bool
+crc32_set_engine(const char *name)
+{
+	uint32_t i;
+
+	for (i = 0; i < crc_usable; i++) {
+		if (strcmp(crc_engines[i].ce_name, name) == 0) {
+			crc_engine = i;
+			return (true);
+		}
+	}
+	return (false);
+}
+
+void
+init_crc(void)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < 256; i++)
+		crc_slice[0][i] = crc_table[i];
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			crc_slice[j][i] = (crc_slice[j - 1][i] >> 8) ^
+			    crc_table[crc_slice[j - 1][i] & 0xff];
+		}
+	}
+
+#ifdef CRC_PCLMUL
+	if (cpu_has_pclmul())
+		crc_usable = CRC_NENGINES;
+#endif
+
+	/* Engines are listed slowest first; take the last one we can use. */
+	crc_engine = crc_usable - 1;
+}
@@ -0,0 +1,36 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2023 MNX Cloud, Inc.
+ */
+
+#ifndef _CRC_H
+#define	_CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * CRC32 (CRC32_POLY, reflected) as used on the SVP wire.  crc32_buf()
+ * advances a raw CRC register, exactly like the CRC32() macro in
+ * crc32.h, so callers do their own pre/post inversion.
+ */
+extern void init_crc(void);
+extern uint32_t crc32_buf(uint32_t, const void *, size_t);
+extern const char *crc32_engine(void);
+extern bool crc32_set_engine(const char *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CRC_H */
@@ -0,0 +1,83 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2023 MNX Cloud, Inc.
+ */
+
+/*
+ * `make check`: every CRC32 engine in crc.c this CPU can run must agree
+ * with the plain CRC32_TABLE over a spread of lengths and alignments,
+ * including the short heads and tails the faster engines hand off.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "crc.h"
+#include "crc32.h"
+
+#define	CHECK_SIZE	4096
+
+static const uint32_t ref_table[256] = { CRC32_TABLE };
+static const char *engines[] = { "table", "slice8", "pclmul" };
+
+static uint32_t
+ref_crc(const uint8_t *buf, size_t len)
+{
+	uint32_t crc;
+
+	CRC32(crc, buf, len, -1U, ref_table);
+	return (~crc);
+}
+
+int
+main(void)
+{
+	static uint8_t buf[CHECK_SIZE + 8];
+	uint32_t seed = 0x5eed, want, got;
+	size_t i, off, len;
+	int failures = 0, before;
+
+	init_crc();
+	for (i = 0; i < sizeof (buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	/* The standard check value, so the reference itself is right. */
+	if (ref_crc((const uint8_t *)"123456789", 9) != 0xcbf43926)
+		errx(1, "CRC32_TABLE doesn't produce the check value");
+
+	for (i = 0; i < sizeof (engines) / sizeof (engines[0]); i++) {
+		if (!crc32_set_engine(engines[i])) {
+			(void) printf("%s: not supported here, skipped\n",
+			    engines[i]);
+			continue;
+		}
+		before = failures;
+		for (off = 0; off < 8; off++) {
+			for (len = 0; len <= CHECK_SIZE;
+			    len += (len < 320 ? 1 : 61)) {
+				want = ref_crc(buf + off, len);
+				got = ~crc32_buf(-1U, buf + off, len);
+				if (got == want)
+					continue;
+				warnx("%s: got 0x%x, wanted 0x%x (offset %zu, "
+				    "len %zu)", engines[i], got, want, off,
+				    len);
+				failures++;
+			}
+		}
+		(void) printf("%s: %s\n", engines[i],
+		    failures == before ? "ok" : "FAILED");
+	}
+
+	if (failures != 0)
+		errx(1, "%d mismatches", failures);
+	return (0);
+}
@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <arpa/inet.h>
 
 #include <linux/sockios.h>
 #include <linux/if.h>
@@ -31,6 +32,8 @@
 
 #include "svp.h"
 #include "link.h"
+#include "cache.h"
+#include "pool.h"
 
 #define	LINUX_SYSFS_VNICS "/sys/devices/virtual/net"
 #define	LINUX_PROCFS_VNICS_IPV4 "/proc/sys/net/ipv4/neigh"
@@ -39,6 +42,17 @@
 static int32_t linktab_size = 0;	/* Same range as ifindex */
 static fabric_link_t **linktab = NULL;
 #define	LINKTAB_START_SIZE 64
+#define	RC_INTERVAL_MS	(60 * 1000)	/* Between reconciliation passes */
+static varpd_pool_t link_pool;	/* Of fabric_link_t */
+
+static void schedule_reconcile(uint64_t);
+static void unindex_link(int32_t);
+
+/* vxlan links by vnetid, chained on fl_vnext. */
+#define	VNETTAB_SHIFT	8
+#define	VNETTAB_SIZE	(1 << VNETTAB_SHIFT)
+#define	VNET_HASH(id)	(((uint32_t)(id) * 2654435769U) >> (32 - VNETTAB_SHIFT))
+static fabric_link_t *vnettab[VNETTAB_SIZE];
 
 static void
 resize_linktab(int32_t newsize)
@@ -79,13 +93,21 @@ update_link_entry(fabric_link_t *parent, const char *name, int32_t index,
 
 	if (linktab[index] == NULL) {
 		/* Just allocate, fill, and return. */
-		dst = malloc(sizeof (*dst));
-		if (dst == NULL)
-			errx(-34, "Can't allocate new linktab entry!");
+		dst = pool_alloc(&link_pool);
 		linktab[index] = dst;
 		dst->fl_vxlan = parent; /* Might be NULL... */
 		dst->fl_ifindex = index;
 		dst->fl_id = id;
+		dst->fl_children = NULL;
+		if (parent == NULL) {
+			dst->fl_sibling = NULL;
+			dst->fl_vnext = vnettab[VNET_HASH(id)];
+			vnettab[VNET_HASH(id)] = dst;
+		} else {
+			dst->fl_vnext = NULL;
+			dst->fl_sibling = parent->fl_children;
+			parent->fl_children = dst;
+		}
 		if (strlcpy(dst->fl_name, name, sizeof (dst->fl_name)) >=
 		    sizeof (dst->fl_name)) {
 			errno = EINVAL;
@@ -114,6 +136,40 @@ update_link_entry(fabric_link_t *parent, const char *name, int32_t index,
 	return (dst);
 }
 
+/*
+ * Forget link "index".  A vxlan link takes its vlan and fabric links with
+ * it; the kernel deletes those too, but we mustn't be left pointing at a
+ * freed fl_vxlan meanwhile.
+ */
+static void
+remove_link_entry(int32_t index)
+{
+	fabric_link_t *fl, **flp;
+
+	if (index < 0 || index >= linktab_size ||
+	    (fl = linktab[index]) == NULL)
+		return;
+
+	if (fl->fl_vxlan == NULL) {
+		while (fl->fl_children != NULL)
+			remove_link_entry(fl->fl_children->fl_ifindex);
+		flp = &vnettab[VNET_HASH(fl->fl_id)];
+		while (*flp != fl)
+			flp = &(*flp)->fl_vnext;
+		*flp = fl->fl_vnext;
+	} else {
+		flp = &fl->fl_vxlan->fl_children;
+		while (*flp != fl)
+			flp = &(*flp)->fl_sibling;
+		*flp = fl->fl_sibling;
+	}
+
+	linktab[index] = NULL;
+	purge_shadow(index);
+	unindex_link(index);
+	pool_free(&link_pool, fl);
+}
+
 /*
  * This function assumes only one entry matching "lower_prefix" is present.
  * If a link directory has more than one, we're in a WORLD of hurt.
@@ -219,6 +275,8 @@ chase_down(DIR *fabricd)
 		/* Shoot, we gotta initialize this first. */
 		vxlan_fl = update_link_entry(NULL, &(vxlan->d_name[6]),
 		    vxlanindex, vxlan_id);
+		/* A vnet we've not seen; preload what Portolan knows. */
+		request_svp_bulk();
 	}
 	vlan_fl = update_link_entry(vxlan_fl, &(vlan->d_name[6]), vlanindex,
 	    vlan_id);
@@ -233,8 +291,12 @@ scan_triton_fabrics(const char *onelink, int32_t onelink_index)
 	DIR *sysfsd;
 	struct dirent *fabric;
 
-	if (linktab_size == 0)
+	if (linktab_size == 0) {
 		resize_linktab(LINKTAB_START_SIZE);
+		init_pool(&link_pool, "links", sizeof (fabric_link_t),
+		    LINKTAB_START_SIZE);
+		schedule_reconcile(RC_INTERVAL_MS);
+	}
 
 	/*
 	 * If we get a non-NULL onelink for something NOT a Triton Fabric,
@@ -346,165 +408,1893 @@ index_to_link(int32_t index)
 	return (linktab[index]);
 }
 
-int
-new_netlink(void)
+/* The vxlan link for vnet "vnetid", if we have one. */
+fabric_link_t *
+vnet_to_link(uint32_t vnetid)
 {
-	struct sockaddr_nl kernel_nladdr = {
-	    .nl_family = AF_NETLINK,
-	    .nl_groups = (RTMGRP_LINK | RTMGRP_IPV4_ROUTE | RTMGRP_NEIGH),
-	    .nl_pid = getpid()
-	};
-	int netlink_fd;
+	fabric_link_t *fl;
 
-	/*
-	 * NETLINK_ROUTE with the above RTMGRP_* flags should be sufficient to
-	 * get everything we need.
-	 */
-	netlink_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
-	if (netlink_fd == -1) {
-		warnx("socket(AF_NETLINK)");
-		return (-1);
+	for (fl = vnettab[VNET_HASH(vnetid)]; fl != NULL; fl = fl->fl_vnext) {
+		if (fl->fl_id == vnetid)
+			return (fl);
 	}
+	return (NULL);
+}
 
-	if (bind(netlink_fd, (struct sockaddr *)&kernel_nladdr,
-	    sizeof (kernel_nladdr)) != -1) {
-		return (netlink_fd);
-	} else
-		err(-1, "bind()");
-
-	/* Should never reach... */
-	(void) close(netlink_fd);
-	return (-1);
+/* Fabric links are the ones that solicit VL3 lookups. */
+static bool
+is_fabric_link(const fabric_link_t *fl)
+{
+	return (strncmp("fabric", fl->fl_name, 6) == 0);
 }
 
 /*
- * Extract ONE message from netlink.
+ * Fill "out" with up to "max" fabric links on vnet "vnetid", VLAN "vid".
+ * Returns how many.
  */
-void
-handle_netlink_inbound(int netlink_fd)
+uint32_t
+find_fabric_links(uint32_t vnetid, uint32_t vid, fabric_link_t **out,
+    uint32_t max)
 {
-	uint8_t buf[4096];
-	uint8_t *readspot = buf, *endspot;
-	struct nlmsghdr *nlmsg = (struct nlmsghdr *)readspot;
-	struct ifinfomsg *ifi;
-	struct ndmsg *ndm;
-	/* XXX KEBE ASKS overkill? Need we worry about more than one? */
-	struct rtattr *rtas[RTA_MAX] = { NULL };
-	ssize_t recvsize;
+	fabric_link_t *vxlan = vnet_to_link(vnetid), *fl;
+	uint32_t n = 0;
 
-	/*
-	 * We read this in all at once, since it's a kernel-originated
-	 * datagram.
-	 */
-	recvsize = recv(netlink_fd, readspot, sizeof (buf), 0);
-	if (recvsize == -1)
-		errx(-7, "recv(netlink)");
+	if (vxlan == NULL)
+		return (0);
+	for (fl = vxlan->fl_children; fl != NULL && n < max;
+	    fl = fl->fl_sibling) {
+		if (fl->fl_id == vid && is_fabric_link(fl))
+			out[n++] = fl;
+	}
+	return (n);
+}
 
-	if (recvsize != nlmsg->nlmsg_len) {
-		warn("DANGER: recvsize %ld != nlmsg_len %d, "
-		    "dropping...\n", recvsize, nlmsg->nlmsg_len);
-		/* Continue for now... */
+/*
+ * Neighbors by MAC.  An SVP_R_SHOOTDOWN names a MAC, and the kernel can't
+ * be asked for neighbors by lladdr, so we keep our own index of which
+ * (fabric ifindex, IP) neighbors resolve to which MAC.  It's filled in as
+ * we write neighbors (write_overlay_ip()) and as reconciliation reads them
+ * back, which also picks up what an earlier varpd left behind.  It's
+ * emptied as they go: our deletes, the kernel's RTM_DELNEIGH, failed
+ * writes (all through forget_neigh() or clear_overlay_ip()), or the link.
+ *
+ * Unlike the shadow (cache.c) it doesn't lapse, since the kernel keeps a
+ * neighbor well past its revalidation.  Each entry is on two chains: by
+ * (ifindex, IP), to find it again on update, and by MAC for shootdowns.
+ * Past MN_MAX, new neighbors just aren't indexed.
+ */
+#define	MN_HASH_SIZE	32768	/* 2^n, for each of the two chains */
+#define	MN_MAX		131072
+
+typedef struct mac_neigh {
+	struct mac_neigh *mn_next;	/* (ifindex, IP) chain */
+	struct mac_neigh *mn_mnext;	/* MAC chain */
+	int32_t mn_ifindex;
+	uint8_t mn_ip[16];
+	uint8_t mn_mac[ETHERADDRL];
+} mac_neigh_t;
+
+static varpd_pool_t mn_pool;		/* Of mac_neigh_t */
+static mac_neigh_t *mn_hash[MN_HASH_SIZE];
+static mac_neigh_t *mn_mhash[MN_HASH_SIZE];
+static uint32_t mn_count;
+static uint64_t mn_full;
+
+static uint32_t
+mn_hashkey(int32_t ifindex, const uint8_t *ip)
+{
+	uint32_t h = (uint32_t)ifindex * 2654435769U, w, i;
+
+	for (i = 0; i < 16; i += sizeof (w)) {
+		(void) memcpy(&w, ip + i, sizeof (w));
+		h = (h ^ w) * 2654435769U;
 	}
-	endspot = readspot;
-	if (recvsize <= nlmsg->nlmsg_len)
-		endspot += recvsize;
-	else
-		endspot += nlmsg->nlmsg_len;
+	return ((h ^ (h >> 16)) & (MN_HASH_SIZE - 1));
+}
 
-	/*
-	 * Right now we really only care about two kinds of messages:
-	 * RTM_GETNEIGH and RTM_NEWNEIGH. RTM_NEWNEIGH indicates failure
-	 * but keep listening for it just in case (including perhaps a
-	 * neighbor going stale).
-	 */
-	switch (nlmsg->nlmsg_type) {
-	case RTM_GETNEIGH:
-		ndm = (struct ndmsg *)(nlmsg + 1);
+static uint32_t
+mn_machash(const uint8_t *mac)
+{
+	uint32_t h = 0, i;
 
-		/*
-		 * Index without state will be handled gracefully
-		 * later. Meanwhile, reality check other ndm fields.
-		 */
+	for (i = 0; i < ETHERADDRL; i++)
+		h = (h ^ mac[i]) * 2654435769U;
+	return ((h ^ (h >> 16)) & (MN_HASH_SIZE - 1));
+}
 
-		/* Only cope with these address requests... */
-		if (ndm->ndm_family != AF_INET && ndm->ndm_family != AF_INET6 &&
-		    ndm->ndm_family != AF_PACKET) {
-			warn("Unkown ndm_family %d", ndm->ndm_family);
-			return;
-		}
-		/*
-		 * Trigger SVP requests for both incomplete AND probe.
-		 * XXX KEBE SAYS need to handle failures on both better.
-		 */
-		if (ndm->ndm_state != NUD_INCOMPLETE &&
-		    ndm->ndm_state != NUD_PROBE) {
-			/* Handle better? Ignore NUD_STALE outright for now. */
-			if (ndm->ndm_state != NUD_STALE)
-				warn("Unknown ndm_state 0x%x", ndm->ndm_state);
-			return;
-		}
-		/* Right now assume NDA_DST is our only trigger. */
-		if (ndm->ndm_type != NDA_DST) {
-			/* Handle better? */
-			warn("Unknown ndm_type 0x%x\n", ndm->ndm_type);
+static mac_neigh_t **
+mn_lookup(int32_t ifindex, const uint8_t *ip)
+{
+	mac_neigh_t **mnp = &mn_hash[mn_hashkey(ifindex, ip)];
+
+	while (*mnp != NULL && ((*mnp)->mn_ifindex != ifindex ||
+	    memcmp((*mnp)->mn_ip, ip, 16) != 0))
+		mnp = &(*mnp)->mn_next;
+	return (mnp);
+}
+
+static void
+mn_unlink_mac(mac_neigh_t *mn)
+{
+	mac_neigh_t **mnp = &mn_mhash[mn_machash(mn->mn_mac)];
+
+	while (*mnp != mn)
+		mnp = &(*mnp)->mn_mnext;
+	*mnp = mn->mn_mnext;
+}
+
+static void
+mn_link_mac(mac_neigh_t *mn)
+{
+	mac_neigh_t **mnp = &mn_mhash[mn_machash(mn->mn_mac)];
+
+	mn->mn_mnext = *mnp;
+	*mnp = mn;
+}
+
+/* Fabric link "ifindex" has (or is about to have) "ip" -> "mac". */
+static void
+index_neigh(int32_t ifindex, const uint8_t *ip, const uint8_t *mac)
+{
+	mac_neigh_t *mn, **mnp = mn_lookup(ifindex, ip);
+
+	if ((mn = *mnp) != NULL) {
+		if (memcmp(mn->mn_mac, mac, ETHERADDRL) == 0)
 			return;
-		}
-		/* XXX KEBE ASKS WTF are the flags for?!? */
+		mn_unlink_mac(mn);
+		(void) memcpy(mn->mn_mac, mac, ETHERADDRL);
+		mn_link_mac(mn);
+		return;
+	}
+	if (mn_count >= MN_MAX) {
+		mn_full++;
+		return;
+	}
+	if (mn_pool.vp_size == 0) {
+		init_pool(&mn_pool, "neighbors by MAC", sizeof (mac_neigh_t),
+		    1024);
+	}
 
-		/* Anyway, on to parsing the extensions. */
-		readspot += sizeof (*nlmsg) + sizeof (*ndm);
-		while (readspot < endspot) {
-			struct rtattr *thisone = (struct rtattr *)readspot;
+	mn = pool_alloc(&mn_pool);
+	mn->mn_ifindex = ifindex;
+	(void) memcpy(mn->mn_ip, ip, 16);
+	(void) memcpy(mn->mn_mac, mac, ETHERADDRL);
+	mn->mn_next = *mnp;
+	*mnp = mn;
+	mn_link_mac(mn);
+	mn_count++;
+}
 
-			rtas[thisone->rta_type] = thisone;
-			readspot += RTA_ALIGN(thisone->rta_len);
+static void
+mn_free(mac_neigh_t **mnp)
+{
+	mac_neigh_t *mn = *mnp;
+
+	*mnp = mn->mn_next;
+	mn_unlink_mac(mn);
+	pool_free(&mn_pool, mn);
+	mn_count--;
+}
+
+/* The kernel no longer has "ip" on fabric link "ifindex". */
+static void
+unindex_neigh(int32_t ifindex, const uint8_t *ip)
+{
+	mac_neigh_t **mnp = mn_lookup(ifindex, ip);
+
+	if (*mnp != NULL)
+		mn_free(mnp);
+}
+
+/* Link "ifindex" is gone, and its neighbors with it. */
+static void
+unindex_link(int32_t ifindex)
+{
+	mac_neigh_t **mnp;
+	uint32_t h;
+
+	for (h = 0; h < MN_HASH_SIZE && mn_count != 0; h++) {
+		mnp = &mn_hash[h];
+		while (*mnp != NULL) {
+			if ((*mnp)->mn_ifindex == ifindex)
+				mn_free(mnp);
+			else
+				mnp = &(*mnp)->mn_next;
 		}
+	}
+}
 
-		/*
-		 * Alright, I expect:
-		 * - NDA_DST, a destination address (raw, use ndm_family above
-		 *   for type)
-		 * - NDA_CACHEINFO, stats on entries I don't need immediately.
-		 * - NDA_PROBES, number of probes or probe number sent?!?
-		 *
-		 * Really I only need the NDA_DST to construct a portolan
-		 * request.  Do the delayed ndm_family check here as well.
-		 *
-		 * We *do* need a way to convery the ifindex to a vnetid for
-		 * SVP, but we let the SVP functions handle that themselves.
-		 */
-		switch (ndm->ndm_family) {
-		case AF_INET: {
-			struct in6_addr v6addr;
+/*
+ * Kernel updates, FDB entries on the vxlan links (AF_BRIDGE, built the way
+ * "bridge fdb replace/del ... self" would) and neighbor entries on the
+ * fabric links (AF_INET/AF_INET6), are RTM_NEWNEIGH/RTM_DELNEIGH messages
+ * on a NETLINK_ROUTE socket of their own, not the one new_netlink() makes
+ * to listen on.
+ *
+ * Between begin_link_batch() and end_link_batch() they pile up in nl_out,
+ * and go to the kernel together, in one sendmsg(), at the outermost
+ * end_link_batch() (or sooner if nl_out fills).  main() brackets each
+ * trip around the event loop this way.  Outside a batch, each goes alone.
+ *
+ * Every message asks for an ACK, and until it's had one it holds a slot
+ * in nl_window, indexed by its sequence number, with a copy of itself.
+ * We never wait for ACKs: they're read without blocking after each
+ * sendmsg() (the kernel has dealt with the lot by the time that returns)
+ * and whenever main() sees nl_fd readable.  A transient failure (see
+ * nl_transient()) is resent after a backoff, as is anything whose ACK
+ * hasn't turned up in NL_ACK_TIMEOUT_MS (lost to a receive buffer
+ * overflow, say); replaces and deletes are both safe to repeat.  Other
+ * failures are counted by errno and logged.
+ */
+#define	LINK_BATCH_DEPTH	4
+#define	NL_OUT_SIZE		(64 * 1024)
+#define	NL_MSG_MAX		128	/* Biggest message we build */
+#define	NL_RCVBUF		(1024 * 1024)
+#define	NL_WINDOW		4096	/* Unacknowledged messages, 2^n */
+#define	NL_ACK_TIMEOUT_MS	1000
+#define	NL_RETRY_MS		10	/* Doubling per try */
+#define	NL_MAX_TRIES		5
+#define	NL_ERRNO_MAX		256
 
-			/* Uggh, SVP requires v4mapped... do it here. */
-			warn("Sending l3 req");
-			IN6_INADDR_TO_V4MAPPED(
-			    (struct in_addr *)RTA_DATA(rtas[RTA_DST]), &v6addr);
-			send_l3_req(ndm->ndm_ifindex, AF_INET, v6addr.s6_addr);
+typedef struct nl_pending {
+	uint32_t np_seq;		/* 0 if the slot is free */
+	uint32_t np_origin;		/* SVP id of the answer, or 0 */
+	uint32_t np_tries;		/* Transmissions so far */
+	uint64_t np_due_ms;		/* Resend if no ACK by then */
+	bool np_retry;			/* Failed transiently, not yet resent */
+	uint8_t np_msg[NL_MSG_MAX];	/* The request, from its nlmsghdr */
+} nl_pending_t;
+
+static int nl_fd = -1;
+static uint8_t nl_out[NL_OUT_SIZE];
+static size_t nl_out_len;
+static uint32_t nl_seq;
+static uint32_t nl_origin;		/* See set_link_origin() */
+static nl_pending_t nl_window[NL_WINDOW];
+static uint32_t nl_inflight;
+static varpd_timer_t nl_timer;
+static uint32_t batch_depth;
+static uint64_t batch_msgs;
+static uint64_t batch_marks[LINK_BATCH_DEPTH];	/* batch_msgs at begin */
+static uint64_t nl_msgs, nl_sends, nl_acks, nl_retries, nl_timeouts;
+static uint64_t nl_evicted, nl_stray, nl_overflows, nl_failures, nl_elided;
+static uint64_t nl_unlearned;		/* Cached answers the kernel refused */
+static uint64_t nl_errno_counts[NL_ERRNO_MAX];
+
+static void flush_link_updates(void);
+static void handle_refresh_reply(const struct nlmsghdr *);
+static void handle_refresh_error(void);
+static void dump_refresh_stats(void);
+static void dump_reconcile_stats(void);
+
+/* Worth trying again in a moment. */
+static bool
+nl_transient(int error)
+{
+	return (error == EBUSY || error == ENOBUFS || error == EAGAIN ||
+	    error == ENOMEM || error == EINTR);
+}
+
+static const char *
+nl_describe(const nl_pending_t *np)
+{
+	static char buf[80];
+	const struct nlmsghdr *nlh = (const struct nlmsghdr *)np->np_msg;
+	const struct ndmsg *ndm = NLMSG_DATA(nlh);
+	const fabric_link_t *fl = index_to_link(ndm->ndm_ifindex);
+	int n;
+
+	n = snprintf(buf, sizeof (buf), "%s %s on %s",
+	    ndm->ndm_family == AF_BRIDGE ? "FDB" : "neighbor",
+	    nlh->nlmsg_type == RTM_NEWNEIGH ? "replace" : "delete",
+	    fl != NULL ? fl->fl_name : "a vanished link");
+	if (np->np_origin != 0 && n > 0 && (size_t)n < sizeof (buf)) {
+		(void) snprintf(buf + n, sizeof (buf) - n,
+		    " for SVP transaction 0x%x", np->np_origin);
+	}
+	return (buf);
+}
+
+/* What a neighbor message (ours or the kernel's) says, as far as we care. */
+typedef struct neigh_info {
+	const uint8_t *ni_lladdr;	/* NULL if none, or not a MAC */
+	uint8_t ni_ip[16];		/* NDA_DST, v4-mapped for IPv4 */
+	bool ni_have_ip;
+	uint16_t ni_port;		/* NDA_PORT, network order, or 0 */
+	uint16_t ni_vid;		/* NDA_VLAN, if ni_tagged */
+	bool ni_tagged;
+} neigh_info_t;
+
+static void
+parse_neigh(const struct nlmsghdr *nlh, neigh_info_t *ni)
+{
+	const struct ndmsg *ndm = NLMSG_DATA(nlh);
+	const struct rtattr *rta;
+	int len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof (*ndm));
+
+	(void) memset(ni, 0, sizeof (*ni));
+	for (rta = (const struct rtattr *)((const uint8_t *)ndm +
+	    NLMSG_ALIGN(sizeof (*ndm))); RTA_OK(rta, len);
+	    rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case NDA_DST:
+			if (RTA_PAYLOAD(rta) == sizeof (in_addr_t)) {
+				IN6_INADDR_TO_V4MAPPED(
+				    (const struct in_addr *)RTA_DATA(rta),
+				    (struct in6_addr *)ni->ni_ip);
+				ni->ni_have_ip = true;
+			} else if (RTA_PAYLOAD(rta) == 16) {
+				(void) memcpy(ni->ni_ip, RTA_DATA(rta), 16);
+				ni->ni_have_ip = true;
+			}
 			break;
-		}
-		case AF_INET6:
-			warn("Sending l3 req (v6)");
-			send_l3_req(ndm->ndm_ifindex, AF_INET6,
-			    RTA_DATA(rtas[RTA_DST]));
+		case NDA_LLADDR:
+			if (RTA_PAYLOAD(rta) == ETHERADDRL)
+				ni->ni_lladdr = RTA_DATA(rta);
 			break;
-		case AF_PACKET: {
-			uint64_t arg = 0;
-
-			warn("Sending l2 req");
-			memcpy(&arg, RTA_DATA(rtas[RTA_DST]), ETHERADDRL);
-			/* Cheesy use of 64-bit ints for MAC. */
-			send_l2_req(ndm->ndm_ifindex, arg);
+		case NDA_PORT:
+			if (RTA_PAYLOAD(rta) == sizeof (ni->ni_port))
+				(void) memcpy(&ni->ni_port, RTA_DATA(rta),
+				    sizeof (ni->ni_port));
+			break;
+		case NDA_VLAN:
+			if (RTA_PAYLOAD(rta) == sizeof (ni->ni_vid)) {
+				(void) memcpy(&ni->ni_vid, RTA_DATA(rta),
+				    sizeof (ni->ni_vid));
+				ni->ni_tagged = true;
+			}
 			break;
 		}
-		default:
-			/* Handle better? */
-			warn("Unknown ndm_family %d\n", ndm->ndm_family);
-		}
-		break;
-	case RTM_NEWNEIGH:
-		/* XXX KEBE SAYS we may need to act on these. */
+	}
+}
+
+/*
+ * The kernel has no FDB entry for "mac" on vxlan link "index" (an l2miss,
+ * or an untagged delete); trust none of its FDB shadows, whatever VLAN.
+ */
+static void
+forget_fdb_shadows(int32_t index, const uint8_t *mac)
+{
+	fabric_link_t *link = index_to_link(index), *fl;
+
+	if (link == NULL || link->fl_vxlan != NULL)
+		return;
+	remove_fdb_shadow(index, mac, 0);
+	for (fl = link->fl_children; fl != NULL; fl = fl->fl_sibling) {
+		if (is_fabric_link(fl))
+			remove_fdb_shadow(index, mac, fl->fl_id);
+	}
+}
+
+/*
+ * The kernel has dropped, or never took, the entry "nlh" (a request of
+ * ours or an RTM_DELNEIGH notification) names; stop shadowing it.  vxlan
+ * keeps one FDB entry per MAC and never reports NDA_VLAN, so an untagged
+ * bridge message covers the MAC on every VLAN.
+ */
+static void
+forget_neigh(const struct nlmsghdr *nlh)
+{
+	const struct ndmsg *ndm = NLMSG_DATA(nlh);
+	neigh_info_t ni;
+
+	parse_neigh(nlh, &ni);
+	if (ndm->ndm_family == AF_BRIDGE) {
+		if (ni.ni_lladdr == NULL)
+			return;
+		if (ni.ni_tagged)
+			remove_fdb_shadow(ndm->ndm_ifindex, ni.ni_lladdr,
+			    ni.ni_vid);
+		else
+			forget_fdb_shadows(ndm->ndm_ifindex, ni.ni_lladdr);
+	} else if (ni.ni_have_ip) {
+		remove_neigh_shadow(ndm->ndm_ifindex, ni.ni_ip);
+		unindex_neigh(ndm->ndm_ifindex, ni.ni_ip);
+	}
+}
+
+/*
+ * Request "np" failed for good (or was never acknowledged), with "error".
+ * Besides the shadow, forget the cached answer it was programming, so the
+ * kernel's next solicitation goes back to Portolan rather than replaying
+ * what was just refused, and count it against the link it was for.
+ */
+static void
+link_write_failed(nl_pending_t *np, int error)
+{
+	const struct nlmsghdr *nlh = (const struct nlmsghdr *)np->np_msg;
+	const struct ndmsg *ndm = NLMSG_DATA(nlh);
+	fabric_link_t *fl = index_to_link(ndm->ndm_ifindex);
+	neigh_info_t ni;
+	uint32_t vnetid;
+
+	nl_failures++;
+	nl_errno_counts[error < NL_ERRNO_MAX ? error : 0]++;
+	warnx("Kernel %s (seq %u, %u tries) failed: %s", nl_describe(np),
+	    np->np_seq, np->np_tries, strerror(error));
+	forget_neigh(nlh);
+	if (fl == NULL)
+		return;	/* Gone, and RTM_DELLINK cleans up after it. */
+	fl->fl_write_failures++;
+	if (nlh->nlmsg_type != RTM_NEWNEIGH)
+		return;
+
+	parse_neigh(nlh, &ni);
+	vnetid = (fl->fl_vxlan != NULL) ? fl->fl_vxlan->fl_id : fl->fl_id;
+	if (ndm->ndm_family == AF_BRIDGE && ni.ni_lladdr != NULL) {
+		remove_vl2_mapping(vnetid, ni.ni_lladdr);
+		nl_unlearned++;
+	} else if (ndm->ndm_family != AF_BRIDGE && ni.ni_have_ip) {
+		remove_vl3_mapping(vnetid, ni.ni_ip);
+		nl_unlearned++;
+	}
+}
+
+static void
+retire_pending(nl_pending_t *np)
+{
+	np->np_seq = 0;
+	np->np_retry = false;
+	nl_inflight--;
+}
+
+/* An ACK, or an error, for request "seq". */
+static void
+handle_link_ack(uint32_t seq, int error)
+{
+	nl_pending_t *np = &nl_window[seq & (NL_WINDOW - 1)];
+
+	if (seq == 0 || np->np_seq != seq) {
+		nl_stray++;	/* Already retired: resent, or evicted. */
+		return;
+	}
+	if (error == 0 || (error == ENOENT &&
+	    ((struct nlmsghdr *)np->np_msg)->nlmsg_type == RTM_DELNEIGH)) {
+		/* Deleting what isn't there is fine. */
+		nl_acks++;
+		retire_pending(np);
+		return;
+	}
+	if (nl_transient(error) && np->np_tries < NL_MAX_TRIES) {
+		np->np_retry = true;
+		np->np_due_ms = now_ms() + (NL_RETRY_MS << (np->np_tries - 1));
+		if (!timer_armed(&nl_timer) ||
+		    nl_timer.vt_expire > np->np_due_ms)
+			arm_timer(&nl_timer, np->np_due_ms - now_ms());
+		return;
+	}
+
+	link_write_failed(np, error);
+	retire_pending(np);
+}
+
+/*
+ * Read whatever ACKs are waiting, without blocking.  main() calls this
+ * when nl_fd is readable.
+ */
+void
+handle_link_acks(void)
+{
+	uint8_t buf[16384];
+	struct nlmsghdr *nlh;
+	struct nlmsgerr *nle;
+	ssize_t len;
+
+	if (nl_fd == -1)
+		return;
+	/* Refreshes answer replies; send them when we're done here. */
+	begin_link_batch();
+	for (;;) {
+		len = recv(nl_fd, buf, sizeof (buf), MSG_DONTWAIT);
+		if (len == -1 && errno == ENOBUFS) {
+			/* Whatever was lost gets resent on its timeout. */
+			nl_overflows++;
+			continue;
+		}
+		if (len <= 0)
+			break;
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		    nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == RTM_NEWNEIGH) {
+				handle_refresh_reply(nlh);
+				continue;
+			}
+			if (nlh->nlmsg_type != NLMSG_ERROR)
+				continue;
+			nle = NLMSG_DATA(nlh);
+			if (nle->msg.nlmsg_type == RTM_GETNEIGH) {
+				handle_refresh_error();
+				continue;
+			}
+			handle_link_ack(nle->msg.nlmsg_seq, -nle->error);
+		}
+	}
+	(void) end_link_batch();
+}
+
+/* For main() to poll(); -1 until the first update. */
+int
+link_update_fd(void)
+{
+	return (nl_fd);
+}
+
+/* Put the request in "np" (back) on the end of nl_out. */
+static void
+queue_pending(nl_pending_t *np)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)np->np_msg;
+
+	/* Refresh replies read during a flush can queue more; see below. */
+	while (nl_out_len + NLMSG_ALIGN(nlh->nlmsg_len) > sizeof (nl_out))
+		flush_link_updates();
+	(void) memcpy(nl_out + nl_out_len, nlh, nlh->nlmsg_len);
+	nl_out_len += NLMSG_ALIGN(nlh->nlmsg_len);
+	np->np_tries++;
+	np->np_retry = false;
+	np->np_due_ms = now_ms() + NL_ACK_TIMEOUT_MS;
+	if (!timer_armed(&nl_timer))
+		arm_timer(&nl_timer, NL_ACK_TIMEOUT_MS);
+}
+
+/* Resend what's due: transient failures, and ACKs that never came. */
+static void
+link_update_timer(void *arg)
+{
+	uint64_t now = now_ms(), next = UINT64_MAX;
+	nl_pending_t *np;
+	uint32_t i;
+
+	begin_link_batch();
+	for (i = 0; i < NL_WINDOW; i++) {
+		np = &nl_window[i];
+		if (np->np_seq == 0)
+			continue;
+		if (np->np_due_ms > now) {
+			if (np->np_due_ms < next)
+				next = np->np_due_ms;
+			continue;
+		}
+		if (!np->np_retry) {
+			nl_timeouts++;
+			if (np->np_tries >= NL_MAX_TRIES) {
+				link_write_failed(np, ETIMEDOUT);
+				retire_pending(np);
+				continue;
+			}
+		}
+		nl_retries++;
+		queue_pending(np);
+		if (np->np_due_ms < next)
+			next = np->np_due_ms;
+	}
+	if (next != UINT64_MAX)
+		arm_timer(&nl_timer, next - now);
+	(void) end_link_batch();
+}
+
+/* Send everything queued in nl_out, in one go, then pick up the ACKs. */
+static void
+flush_link_updates(void)
+{
+	struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+	struct iovec iov = { .iov_base = nl_out, .iov_len = nl_out_len };
+	struct msghdr msg = {
+		.msg_name = &kernel,
+		.msg_namelen = sizeof (kernel),
+		.msg_iov = &iov,
+		.msg_iovlen = 1
+	};
+
+	if (nl_out_len == 0)
+		return;
+	while (sendmsg(nl_fd, &msg, 0) == -1) {
+		if (errno == EINTR)
+			continue;
+		/* Everything in it is in nl_window, and will be resent. */
+		warn("flush_link_updates(): sendmsg(%lu bytes)", nl_out_len);
+		break;
+	}
+	nl_sends++;
+	nl_out_len = 0;
+	handle_link_acks();
+}
+
+/*
+ * Updates queued from here on program the answer to SVP transaction "id"
+ * (0 when they don't come from one), so a failure can be traced back to
+ * it; see link_write_failed().
+ */
+void
+set_link_origin(uint32_t id)
+{
+	nl_origin = id;
+}
+
+void
+begin_link_batch(void)
+{
+	assert(batch_depth < LINK_BATCH_DEPTH);
+	batch_marks[batch_depth++] = batch_msgs;
+}
+
+/* Returns how many kernel updates were queued since the matching begin. */
+uint64_t
+end_link_batch(void)
+{
+	uint64_t msgs;
+
+	assert(batch_depth > 0);
+	msgs = batch_msgs - batch_marks[--batch_depth];
+	if (batch_depth == 0)
+		flush_link_updates();
+	return (msgs);
+}
+
+static void
+open_update_socket(void)
+{
+	int one = 1, rcvbuf = NL_RCVBUF;
+
+	if (nl_fd != -1)
+		return;
+	nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nl_fd == -1)
+		err(-22, "open_update_socket(): socket(AF_NETLINK)");
+	/*
+	 * ACKs needn't echo back the whole request, and there's room for one
+	 * per message in a few full nl_outs.
+	 */
+	(void) setsockopt(nl_fd, SOL_NETLINK, NETLINK_CAP_ACK, &one,
+	    sizeof (one));
+	if (setsockopt(nl_fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf,
+	    sizeof (rcvbuf)) == -1) {
+		(void) setsockopt(nl_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+		    sizeof (rcvbuf));
+	}
+	nl_timer.vt_func = link_update_timer;
+}
+
+/*
+ * Start a neighbor message in its own nl_window slot.  Add attributes with
+ * add_neigh_attr(), then queue it with finish_neigh_msg().
+ */
+static struct nlmsghdr *
+start_neigh_msg(uint16_t type, uint8_t family, int32_t ifindex,
+    uint16_t state, uint8_t flags)
+{
+	nl_pending_t *np;
+	struct nlmsghdr *nlh;
+	struct ndmsg *ndm;
+
+	open_update_socket();
+	if (++nl_seq == 0)
+		nl_seq = 1;
+	np = &nl_window[nl_seq & (NL_WINDOW - 1)];
+	if (np->np_seq != 0) {
+		/* Window's full; make room by collecting ACKs. */
+		flush_link_updates();
+		if (np->np_seq != 0) {
+			nl_evicted++;
+			forget_neigh((struct nlmsghdr *)np->np_msg);
+			retire_pending(np);
+		}
+	}
+
+	nlh = (struct nlmsghdr *)np->np_msg;
+	(void) memset(nlh, 0, NLMSG_SPACE(sizeof (*ndm)));
+	nlh->nlmsg_len = NLMSG_LENGTH(sizeof (*ndm));
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	if (type == RTM_NEWNEIGH)
+		nlh->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+	nlh->nlmsg_seq = nl_seq;
+	ndm = NLMSG_DATA(nlh);
+	ndm->ndm_family = family;
+	ndm->ndm_ifindex = ifindex;
+	ndm->ndm_state = state;
+	ndm->ndm_flags = flags;
+	return (nlh);
+}
+
+static void
+add_neigh_attr(struct nlmsghdr *nlh, uint16_t type, const void *data,
+    size_t len)
+{
+	struct rtattr *rta = (struct rtattr *)((uint8_t *)nlh +
+	    NLMSG_ALIGN(nlh->nlmsg_len));
+
+	assert(NLMSG_ALIGN(nlh->nlmsg_len) + RTA_SPACE(len) <= NL_MSG_MAX);
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	(void) memcpy(RTA_DATA(rta), data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/* An address we keep v4-mapped goes to the kernel as plain IPv4. */
+static void
+add_neigh_addr(struct nlmsghdr *nlh, const uint8_t *addr)
+{
+	if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)addr))
+		add_neigh_attr(nlh, NDA_DST, addr + 12, sizeof (in_addr_t));
+	else
+		add_neigh_attr(nlh, NDA_DST, addr, sizeof (struct in6_addr));
+}
+
+static void
+finish_neigh_msg(struct nlmsghdr *nlh)
+{
+	nl_pending_t *np = (nl_pending_t *)((uint8_t *)nlh -
+	    offsetof(nl_pending_t, np_msg));
+
+	np->np_seq = nlh->nlmsg_seq;
+	np->np_origin = nl_origin;
+	np->np_tries = 0;
+	nl_inflight++;
+	queue_pending(np);
+	nl_msgs++;
+	batch_msgs++;
+	if (batch_depth == 0)
+		flush_link_updates();
+}
+
+void
+dump_link_stats(void)
+{
+	const fabric_link_t *fl;
+	int32_t i;
+	uint32_t e;
+
+	warnx("Kernel updates: %lu sent in %lu sendmsg()s, %lu elided as "
+	    "redundant, %u awaiting ACK, %lu ACKed, %lu failed", nl_msgs,
+	    nl_sends, nl_elided, nl_inflight, nl_acks, nl_failures);
+	warnx("Kernel updates: %lu resent (%lu for lost ACKs), %lu evicted "
+	    "unACKed, %lu stray ACKs, %lu overflows", nl_retries, nl_timeouts,
+	    nl_evicted, nl_stray, nl_overflows);
+	for (e = 0; e < NL_ERRNO_MAX; e++) {
+		if (nl_errno_counts[e] != 0) {
+			warnx("Kernel updates: %lu failed with %s",
+			    nl_errno_counts[e], strerror(e));
+		}
+	}
+	for (i = 0; i < linktab_size; i++) {
+		if ((fl = linktab[i]) != NULL && fl->fl_write_failures != 0) {
+			warnx("Kernel updates: %lu failed on %s",
+			    fl->fl_write_failures, fl->fl_name);
+		}
+	}
+	warnx("Kernel updates: %lu cached answers dropped after failing",
+	    nl_unlearned);
+	warnx("Neighbors by MAC: %u indexed, %lu over limit", mn_count,
+	    mn_full);
+	dump_refresh_stats();
+	dump_reconcile_stats();
+}
+
+/*
+ * Point "mac", VLAN "vid", on vxlan link "vxlan" at underlay "uip", port
+ * "uport" (network order) if Portolan gave one.  Many IPs can sit behind
+ * one MAC, so this is very often already so; the shadow (see cache.c)
+ * spares the kernel those writes.  Deletes always go out, since the
+ * kernel may hold entries we never shadowed (from before a restart, say).
+ */
+static void
+set_overlay_mac(const uint8_t *mac, const uint8_t *uip, uint16_t uport,
+    const fabric_link_t *vxlan, uint16_t vid)
+{
+	struct nlmsghdr *nlh;
+
+	if (!update_fdb_shadow(vxlan->fl_ifindex, mac, vid, uip, uport)) {
+		nl_elided++;
+		return;
+	}
+
+	nlh = start_neigh_msg(RTM_NEWNEIGH, AF_BRIDGE, vxlan->fl_ifindex,
+	    NUD_NOARP | NUD_PERMANENT, NTF_SELF);
+	add_neigh_attr(nlh, NDA_LLADDR, mac, ETHERADDRL);
+	/* The kernel refuses VLAN 0; untagged means no NDA_VLAN at all. */
+	if (vid != 0)
+		add_neigh_attr(nlh, NDA_VLAN, &vid, sizeof (vid));
+	add_neigh_addr(nlh, uip);
+	if (uport != 0)
+		add_neigh_attr(nlh, NDA_PORT, &uport, sizeof (uport));
+	finish_neigh_msg(nlh);
+}
+
+/*
+ * Resolve "ip" to "mac" on fabric link "ifindex".  NUD_REACHABLE, not
+ * permanent, so the kernel asks again once it goes stale.
+ */
+static void
+write_overlay_ip(const uint8_t *ip, const uint8_t *mac, int32_t ifindex)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = start_neigh_msg(RTM_NEWNEIGH,
+	    IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)ip) ?
+	    AF_INET : AF_INET6, ifindex, NUD_REACHABLE, 0);
+	add_neigh_addr(nlh, ip);
+	add_neigh_attr(nlh, NDA_LLADDR, mac, ETHERADDRL);
+	finish_neigh_msg(nlh);
+	index_neigh(ifindex, ip, mac);
+}
+
+static void
+set_overlay_ip(const uint8_t *ip, const uint8_t *mac,
+    const fabric_link_t *link)
+{
+	if (!update_neigh_shadow(link->fl_ifindex, ip, mac)) {
+		nl_elided++;
+		return;
+	}
+	write_overlay_ip(ip, mac, link->fl_ifindex);
+}
+
+static void
+clear_overlay_mac(const uint8_t *mac, const fabric_link_t *vxlan,
+    uint16_t vid)
+{
+	struct nlmsghdr *nlh;
+
+	remove_fdb_shadow(vxlan->fl_ifindex, mac, vid);
+	nlh = start_neigh_msg(RTM_DELNEIGH, AF_BRIDGE, vxlan->fl_ifindex, 0,
+	    NTF_SELF);
+	add_neigh_attr(nlh, NDA_LLADDR, mac, ETHERADDRL);
+	if (vid != 0)
+		add_neigh_attr(nlh, NDA_VLAN, &vid, sizeof (vid));
+	finish_neigh_msg(nlh);
+}
+
+static void
+clear_overlay_ip(const uint8_t *ip, const fabric_link_t *link)
+{
+	struct nlmsghdr *nlh;
+
+	remove_neigh_shadow(link->fl_ifindex, ip);
+	unindex_neigh(link->fl_ifindex, ip);
+	nlh = start_neigh_msg(RTM_DELNEIGH,
+	    IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)ip) ?
+	    AF_INET : AF_INET6, link->fl_ifindex, 0, 0);
+	add_neigh_addr(nlh, ip);
+	finish_neigh_msg(nlh);
+}
+
+/*
+ * Program the kernel with a VL3 answer on fabric link "link": the overlay
+ * MAC's underlay destination in the vxlan FDB (on the link's VLAN), then
+ * the neighbor entry itself.
+ */
+void
+program_vl3(fabric_link_t *link, const uint8_t *ip, const uint8_t *mac,
+    const uint8_t *uip, uint16_t uport)
+{
+	assert(link->fl_vxlan != NULL);
+
+	set_overlay_mac(mac, uip, uport, link->fl_vxlan, link->fl_id);
+	set_overlay_ip(ip, mac, link);
+}
+
+/* Program the kernel with a VL2 answer on vxlan link "vxlan". */
+void
+program_vl2(fabric_link_t *vxlan, const uint8_t *mac, const uint8_t *uip,
+    uint16_t uport)
+{
+	assert(vxlan->fl_vxlan == NULL);
+
+	set_overlay_mac(mac, uip, uport, vxlan, 0);
+}
+
+/*
+ * Forget "mac" on vxlan link "vxlan": its FDB entries both untagged (from
+ * program_vl2()) and on every VLAN we have a link for (from program_vl3()).
+ * Entries that aren't there just fail, harmlessly.
+ */
+void
+unprogram_vl2(fabric_link_t *vxlan, const uint8_t *mac)
+{
+	fabric_link_t *fl;
+
+	assert(vxlan->fl_vxlan == NULL);
+
+	clear_overlay_mac(mac, vxlan, 0);
+	for (fl = vxlan->fl_children; fl != NULL; fl = fl->fl_sibling) {
+		if (is_fabric_link(fl))
+			clear_overlay_mac(mac, vxlan, fl->fl_id);
+	}
+}
+
+/* Forget the neighbor entry for "ip" on fabric link "link". */
+void
+unprogram_vl3(fabric_link_t *link, const uint8_t *ip)
+{
+	assert(link->fl_vxlan != NULL);
+
+	clear_overlay_ip(ip, link);
+}
+
+/*
+ * Neighbor dumps.  Reconciliation (below) reads the kernel's tables a
+ * link at a time with RTM_GETNEIGH dumps, on a socket of its own so a dump
+ * never gets mixed up with ACKs or events.  Strict checking has the kernel
+ * do the per-link filtering; without it (older kernels) dumps cover every
+ * link, and we check ndm_ifindex anyway.
+ */
+#define	DUMP_BUF_SIZE	(32 * 1024)	/* The kernel's biggest dump skb */
+
+static int
+open_dump_socket(void)
+{
+	int fd, one = 1;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd == -1)
+		err(-23, "open_dump_socket(): socket(AF_NETLINK)");
+	(void) setsockopt(fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &one,
+	    sizeof (one));
+	return (fd);
+}
+
+/* Ask for link "ifindex"'s "family" table (AF_BRIDGE being its FDB). */
+static bool
+send_neigh_dump(int fd, uint32_t seq, uint8_t family, int32_t ifindex)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct ndmsg ndm;
+		struct rtattr rta;
+		uint32_t ifindex;
+	} req;
+
+	/*
+	 * FDB dumps take the link in the header; neighbor dumps insist it be
+	 * zero there, and take NDA_IFINDEX instead.
+	 */
+	(void) memset(&req, 0, sizeof (req));
+	req.nlh.nlmsg_type = RTM_GETNEIGH;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = seq;
+	req.ndm.ndm_family = family;
+	if (family == AF_BRIDGE) {
+		req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof (req.ndm));
+		req.ndm.ndm_ifindex = ifindex;
+	} else {
+		req.nlh.nlmsg_len = sizeof (req);
+		req.rta.rta_type = NDA_IFINDEX;
+		req.rta.rta_len = RTA_LENGTH(sizeof (req.ifindex));
+		req.ifindex = ifindex;
+	}
+	if (send(fd, &req, req.nlh.nlmsg_len, 0) == -1) {
+		warn("send_neigh_dump(): send()");
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * SVP_R_SHOOTDOWN: "mac"'s underlay mapping on vxlan link "vxlan" is bad.
+ * Drop its FDB entries, and the neighbor entries on the vnet's fabric
+ * links that resolve to it (found in the index above, without asking the
+ * kernel), so they all get looked up afresh.  Returns how many neighbors
+ * went.
+ */
+uint32_t
+shootdown_vl2(fabric_link_t *vxlan, const uint8_t *mac)
+{
+	mac_neigh_t *mn, *next;
+	fabric_link_t *fl;
+	uint32_t removed = 0;
+
+	begin_link_batch();
+	unprogram_vl2(vxlan, mac);
+	for (mn = mn_mhash[mn_machash(mac)]; mn != NULL; mn = next) {
+		next = mn->mn_mnext;	/* unprogram_vl3() frees "mn" */
+		if (memcmp(mn->mn_mac, mac, ETHERADDRL) != 0 ||
+		    (fl = index_to_link(mn->mn_ifindex)) == NULL ||
+		    fl->fl_vxlan != vxlan)
+			continue;
+		unprogram_vl3(fl, mn->mn_ip);
+		removed++;
+	}
+	(void) end_link_batch();
+	return (removed);
+}
+
+/*
+ * Neighbor refresh.  Our neighbor entries are NUD_REACHABLE, so after the
+ * link's reachable time the kernel demotes them to STALE (telling us, with
+ * an RTM_NEWNEIGH).  The next packet to one moves it to DELAY, and
+ * delay_first_probe_time (5s by default) later to PROBE, which is when
+ * app_solicit sends us the RTM_GETNEIGH.  Entries programmed together (a
+ * miss storm, a bulk preload) go through all of that together.
+ *
+ * So we watch each STALE neighbor we still shadow, for up to RF_WATCH_MS,
+ * checking it every RF_PERIOD_MS (under the DELAY time) with an
+ * RTM_GETNEIGH of our own.  If NDA_CACHEINFO says it's been used since,
+ * we rewrite it REACHABLE before the kernel gets to PROBE; if not, we
+ * leave it to expire.  (While REACHABLE the kernel doesn't update
+ * ndm_used, so asking any earlier tells us nothing.)  Watched neighbors
+ * sit on a wheel of RF_BUCKETS, each in the bucket its hash picks, so
+ * checks and refreshes are spread evenly however bunched the expiries.
+ */
+#define	RF_BUCKETS	8
+#define	RF_TICK_MS	500
+#define	RF_PERIOD_MS	(RF_BUCKETS * RF_TICK_MS)
+#define	RF_WATCH_MS	(30 * 1000)
+#define	RF_HASH_SIZE	4096	/* 2^n */
+#define	RF_MAX		65536	/* Watched at once */
+
+typedef struct refresh_ent {
+	struct refresh_ent *re_next;	/* Wheel bucket */
+	struct refresh_ent *re_hnext;	/* Hash chain */
+	int32_t re_ifindex;
+	uint8_t re_ip[16];
+	uint64_t re_until_ms;		/* Give up watching then */
+} refresh_ent_t;
+
+static void refresh_tick(void *);
+
+static varpd_pool_t refresh_pool;	/* Of refresh_ent_t */
+static refresh_ent_t *rf_wheel[RF_BUCKETS];
+static refresh_ent_t *rf_hash[RF_HASH_SIZE];
+static uint32_t rf_hand, rf_count;
+static long rf_hz;			/* NDA_CACHEINFO's clock_t */
+static varpd_timer_t rf_timer = { .vt_func = refresh_tick };
+static uint64_t rf_watched, rf_checks, rf_refreshed, rf_idle, rf_gone;
+static uint64_t rf_full;
+
+static uint32_t
+rf_hashkey(int32_t ifindex, const uint8_t *ip)
+{
+	uint32_t h = (uint32_t)ifindex * 2654435769U, w, i;
+
+	for (i = 0; i < 16; i += sizeof (w)) {
+		(void) memcpy(&w, ip + i, sizeof (w));
+		h = (h ^ w) * 2654435769U;
+	}
+	return (h ^ (h >> 16));
+}
+
+static refresh_ent_t **
+rf_lookup(int32_t ifindex, const uint8_t *ip)
+{
+	refresh_ent_t **rep;
+
+	rep = &rf_hash[rf_hashkey(ifindex, ip) & (RF_HASH_SIZE - 1)];
+	while (*rep != NULL && ((*rep)->re_ifindex != ifindex ||
+	    memcmp((*rep)->re_ip, ip, 16) != 0))
+		rep = &(*rep)->re_hnext;
+	return (rep);
+}
+
+/* Stop watching; the wheel unlinks it when it next passes. */
+static void
+unwatch_neighbor(refresh_ent_t *re)
+{
+	refresh_ent_t **rep = rf_lookup(re->re_ifindex, re->re_ip);
+
+	if (*rep == re)
+		*rep = re->re_hnext;
+	re->re_until_ms = 0;
+}
+
+/* Kernel says "ip" on fabric link "ifindex" has gone STALE. */
+static void
+watch_neighbor(int32_t ifindex, const uint8_t *ip)
+{
+	uint8_t mac[ETHERADDRL];
+	refresh_ent_t *re, **rep;
+	uint32_t h;
+
+	if (!find_neigh_shadow(ifindex, ip, mac))
+		return;	/* Not ours, or due a revalidation anyway. */
+	rep = rf_lookup(ifindex, ip);
+	if (*rep != NULL) {
+		(*rep)->re_until_ms = now_ms() + RF_WATCH_MS;
+		return;
+	}
+	if (rf_count >= RF_MAX) {
+		rf_full++;
+		return;
+	}
+	if (refresh_pool.vp_size == 0) {
+		init_pool(&refresh_pool, "neighbor refresh",
+		    sizeof (refresh_ent_t), 1024);
+		rf_hz = sysconf(_SC_CLK_TCK);
+	}
+
+	re = pool_alloc(&refresh_pool);
+	re->re_ifindex = ifindex;
+	(void) memcpy(re->re_ip, ip, 16);
+	re->re_until_ms = now_ms() + RF_WATCH_MS;
+	re->re_hnext = *rep;
+	*rep = re;
+	h = rf_hashkey(ifindex, ip);
+	re->re_next = rf_wheel[(h >> 16) % RF_BUCKETS];
+	rf_wheel[(h >> 16) % RF_BUCKETS] = re;
+	rf_count++;
+	rf_watched++;
+	if (!timer_armed(&rf_timer))
+		arm_timer(&rf_timer, RF_TICK_MS);
+}
+
+/* Ask the kernel about one watched neighbor; see handle_refresh_reply(). */
+static void
+check_neighbor(const refresh_ent_t *re)
+{
+	struct nlmsghdr *nlh;
+	struct ndmsg *ndm;
+	struct rtattr *rta;
+	bool v4 = IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)re->re_ip);
+	size_t alen = v4 ? sizeof (in_addr_t) : 16;
+	size_t len = NLMSG_SPACE(sizeof (*ndm)) + RTA_SPACE(alen);
+
+	open_update_socket();
+	while (nl_out_len + len > sizeof (nl_out))
+		flush_link_updates();
+	nlh = (struct nlmsghdr *)(nl_out + nl_out_len);
+	(void) memset(nlh, 0, len);
+	nlh->nlmsg_len = len;
+	nlh->nlmsg_type = RTM_GETNEIGH;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+	ndm = NLMSG_DATA(nlh);
+	ndm->ndm_family = v4 ? AF_INET : AF_INET6;
+	ndm->ndm_ifindex = re->re_ifindex;
+	rta = (struct rtattr *)((uint8_t *)ndm + NLMSG_ALIGN(sizeof (*ndm)));
+	rta->rta_type = NDA_DST;
+	rta->rta_len = RTA_LENGTH(alen);
+	(void) memcpy(RTA_DATA(rta), v4 ? re->re_ip + 12 : re->re_ip, alen);
+	nl_out_len += len;
+	rf_checks++;
+}
+
+/* Check (or drop) everything in the next wheel bucket. */
+static void
+refresh_tick(void *arg)
+{
+	refresh_ent_t *re, **rep = &rf_wheel[rf_hand];
+	fabric_link_t *fl;
+	uint64_t now = now_ms();
+
+	begin_link_batch();
+	while ((re = *rep) != NULL) {
+		fl = index_to_link(re->re_ifindex);
+		if (re->re_until_ms > now &&
+		    (fl == NULL || !is_fabric_link(fl)))
+			unwatch_neighbor(re);	/* Link went away */
+		if (re->re_until_ms <= now) {
+			if (re->re_until_ms != 0) {
+				rf_idle++;
+				unwatch_neighbor(re);
+			}
+			*rep = re->re_next;
+			pool_free(&refresh_pool, re);
+			rf_count--;
+			continue;
+		}
+		check_neighbor(re);
+		rep = &re->re_next;
+	}
+	rf_hand = (rf_hand + 1) % RF_BUCKETS;
+	if (rf_count != 0)
+		arm_timer(&rf_timer, RF_TICK_MS);
+	(void) end_link_batch();
+}
+
+/*
+ * The kernel's answer (RTM_NEWNEIGH) to check_neighbor(): refresh it if
+ * it's been used since it went stale, and we'd still resolve it the same.
+ */
+static void
+handle_refresh_reply(const struct nlmsghdr *nlh)
+{
+	const struct ndmsg *ndm = NLMSG_DATA(nlh);
+	const struct rtattr *rta;
+	const struct nda_cacheinfo *ci = NULL;
+	const uint8_t *dst = NULL, *lladdr = NULL;
+	uint8_t ip[16], mac[ETHERADDRL];
+	refresh_ent_t *re;
+	int len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof (*ndm));
+
+	for (rta = (const struct rtattr *)((const uint8_t *)ndm +
+	    NLMSG_ALIGN(sizeof (*ndm))); RTA_OK(rta, len);
+	    rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == NDA_DST)
+			dst = RTA_DATA(rta);
+		else if (rta->rta_type == NDA_LLADDR &&
+		    RTA_PAYLOAD(rta) == ETHERADDRL)
+			lladdr = RTA_DATA(rta);
+		else if (rta->rta_type == NDA_CACHEINFO &&
+		    RTA_PAYLOAD(rta) >= sizeof (*ci))
+			ci = RTA_DATA(rta);
+	}
+	if (dst == NULL || lladdr == NULL || ci == NULL)
+		return;
+	if (ndm->ndm_family == AF_INET) {
+		IN6_INADDR_TO_V4MAPPED((const struct in_addr *)dst,
+		    (struct in6_addr *)ip);
+	} else {
+		(void) memcpy(ip, dst, 16);
+	}
+	if ((re = *rf_lookup(ndm->ndm_ifindex, ip)) == NULL)
+		return;
+
+	if (!(ndm->ndm_state & (NUD_STALE | NUD_DELAY | NUD_PROBE))) {
+		/* Refreshed (or failed) some other way. */
+		unwatch_neighbor(re);
+		return;
+	}
+	/*
+	 * Once it's STALE, every packet takes the slow path and updates
+	 * ndm_used, so anything in use shows up well inside a period.
+	 */
+	if ((uint64_t)ci->ndm_used * 1000 / rf_hz >= RF_PERIOD_MS)
+		return;	/* Idle, so far. */
+	if (!find_neigh_shadow(ndm->ndm_ifindex, ip, mac) ||
+	    memcmp(mac, lladdr, ETHERADDRL) != 0) {
+		/* We'd no longer say the same; let it go to PROBE. */
+		unwatch_neighbor(re);
+		return;
+	}
+	write_overlay_ip(ip, mac, ndm->ndm_ifindex);
+	rf_refreshed++;
+	unwatch_neighbor(re);
+}
+
+/*
+ * The kernel's other answer to check_neighbor(): an error, since it no
+ * longer has the neighbor.  Its watch lapses on its own.
+ */
+static void
+handle_refresh_error(void)
+{
+	rf_gone++;
+}
+
+static void
+dump_refresh_stats(void)
+{
+	warnx("Neighbor refresh: %u watched now, %lu ever, %lu checks, "
+	    "%lu refreshed, %lu left idle, %lu vanished, %lu over limit",
+	    rf_count, rf_watched, rf_checks, rf_refreshed, rf_idle, rf_gone,
+	    rf_full);
+}
+
+/*
+ * Reconciliation.  Nothing else notices the kernel's FDB and neighbor
+ * tables drifting from Portolan's answers (events we missed, someone with
+ * "ip neigh"), so every RC_INTERVAL_MS, and soon after the event socket
+ * overflows, a pass dumps each vxlan link's FDB (AF_BRIDGE) and each
+ * fabric link's neighbors (AF_INET, then AF_INET6), one RTM_GETNEIGH dump
+ * at a time (see "Neighbor dumps" above).
+ *
+ * Each entry is checked against the cache as it's read; a dump is never
+ * held in full, only the one recv() of it being parsed.  An entry the
+ * cache disagrees with is rewritten (or, lacking the rest of the answer,
+ * deleted so the kernel asks again); one it agrees with marks its shadow
+ * entry (see cache.c) with this pass's epoch; one it knows nothing of, or
+ * only has an expired answer for, is left alone.  At the end, shadow
+ * entries on fully dumped links that weren't marked are swept: the kernel
+ * no longer has them.
+ *
+ * The pass runs off rc_timer, RC_TICK_MS apart, for at most RC_BUDGET_US
+ * of CPU each time, so it can't hold up miss handling for long whatever
+ * the table sizes.  Corrections from one tick go out in one batch.
+ */
+#define	RC_SOON_MS	1000
+#define	RC_TICK_MS	20
+#define	RC_BUDGET_US	1000
+
+typedef enum rc_state {
+	RC_IDLE = 0,
+	RC_NEXT,		/* Between dumps */
+	RC_DUMPING
+} rc_state_t;
+
+static void reconcile_tick(void *);
+
+static int rc_fd = -1;
+static uint8_t rc_buf[DUMP_BUF_SIZE];
+static size_t rc_len, rc_off;		/* Unparsed part of rc_buf */
+static rc_state_t rc_state;
+static bool rc_again;			/* Asked for again while running */
+static int32_t rc_index;		/* Link being dumped... */
+static uint8_t rc_family;		/* ...which table... */
+static bool rc_clean;			/* ...and all its dumps complete */
+static uint32_t rc_seq, rc_pass;
+static uint64_t rc_start_ms;
+static varpd_timer_t rc_timer = { .vt_func = reconcile_tick };
+static uint64_t rc_passes, rc_dumps, rc_incomplete, rc_entries;
+static uint64_t rc_unknown, rc_fdb_fixed, rc_neigh_fixed, rc_swept;
+static uint64_t rc_lost_events, rc_pass_fixed;
+
+static void
+schedule_reconcile(uint64_t ms)
+{
+	if (rc_state != RC_IDLE) {
+		rc_again = true;
+		return;
+	}
+	if (!timer_armed(&rc_timer) || rc_timer.vt_expire > now_ms() + ms)
+		arm_timer(&rc_timer, ms);
+}
+
+/* For sweep_shadow(): did this pass see all of link "ifindex"? */
+static bool
+rc_dumped(int32_t ifindex)
+{
+	fabric_link_t *fl = index_to_link(ifindex);
+
+	return (fl != NULL && fl->fl_recon == rc_pass);
+}
+
+/* Is "vid" one we write FDB entries on vxlan link "vxlan" with? */
+static bool
+rc_fdb_vid(const fabric_link_t *vxlan, uint16_t vid)
+{
+	const fabric_link_t *fl;
+
+	if (vid == 0)
+		return (true);	/* program_vl2() */
+	for (fl = vxlan->fl_children; fl != NULL; fl = fl->fl_sibling) {
+		if (fl->fl_id == vid && is_fabric_link(fl))
+			return (true);	/* program_vl3() */
+	}
+	return (false);
+}
+
+/* Rewrite "mac", VLAN "vid", on vxlan link "vxlan", shadow or no. */
+static void
+rc_fix_fdb(fabric_link_t *vxlan, const uint8_t *mac, uint16_t vid,
+    const uint8_t *uip, uint16_t uport)
+{
+	remove_fdb_shadow(vxlan->fl_ifindex, mac, vid);
+	set_overlay_mac(mac, uip, uport, vxlan, vid);
+}
+
+/*
+ * The kernel says vxlan link "vxlan" sends "mac" to "kip"/"kport", on VLAN
+ * "vid" if "tagged".  The vxlan driver itself drops NDA_VLAN, keeping one
+ * entry per MAC whatever VLAN it was written with, so an untagged entry is
+ * where all of our writes for the MAC landed: it confirms each of their
+ * shadows it agrees with, and if it's wrong, each of them is rewritten.
+ */
+static void
+reconcile_fdb(fabric_link_t *vxlan, const uint8_t *mac, uint16_t vid,
+    bool tagged, const uint8_t *kip, uint16_t kport)
+{
+	int32_t index = vxlan->fl_ifindex;
+	fabric_link_t *fl;
+	uint8_t uip[16];
+	uint16_t uport;
+	bool fixed = false;
+
+	if (!rc_fdb_vid(vxlan, vid) ||
+	    !peek_vl2_mapping(vxlan->fl_id, mac, uip, &uport)) {
+		rc_unknown++;
+		return;
+	}
+	/* The kernel leaves out NDA_PORT when it's the link's default. */
+	if (memcmp(uip, kip, sizeof (uip)) == 0 &&
+	    (kport == 0 || kport == uport)) {
+		mark_fdb_shadow(index, mac, vid, uip, uport);
+		for (fl = vxlan->fl_children; !tagged && fl != NULL;
+		    fl = fl->fl_sibling) {
+			if (is_fabric_link(fl))
+				mark_fdb_shadow(index, mac, fl->fl_id, uip,
+				    uport);
+		}
+		return;
+	}
+
+	if (!tagged) {
+		for (fl = vxlan->fl_children; fl != NULL;
+		    fl = fl->fl_sibling) {
+			if (is_fabric_link(fl) &&
+			    find_fdb_shadow(index, mac, fl->fl_id)) {
+				rc_fix_fdb(vxlan, mac, fl->fl_id, uip, uport);
+				fixed = true;
+			}
+		}
+	}
+	if (tagged || !fixed || find_fdb_shadow(index, mac, 0))
+		rc_fix_fdb(vxlan, mac, vid, uip, uport);
+	rc_fdb_fixed++;
+	rc_pass_fixed++;
+}
+
+/* The kernel says fabric link "link" resolves "ip" to "kmac". */
+static void
+reconcile_neigh(fabric_link_t *link, const uint8_t *ip, const uint8_t *kmac)
+{
+	uint32_t vnetid = link->fl_vxlan->fl_id;
+	uint8_t mac[ETHERADDRL], uip[16];
+	uint16_t uport;
+
+	if (!peek_vl3_mapping(vnetid, ip, mac)) {
+		rc_unknown++;
+		return;
+	}
+	if (memcmp(mac, kmac, ETHERADDRL) != 0) {
+		remove_neigh_shadow(link->fl_ifindex, ip);
+		if (peek_vl2_mapping(vnetid, mac, uip, &uport))
+			program_vl3(link, ip, mac, uip, uport);
+		else
+			unprogram_vl3(link, ip);
+		rc_neigh_fixed++;
+		rc_pass_fixed++;
+		return;
+	}
+	mark_neigh_shadow(link->fl_ifindex, ip, mac);
+}
+
+/* One RTM_NEWNEIGH from a dump. */
+static void
+reconcile_entry(const struct nlmsghdr *nlh)
+{
+	const struct ndmsg *ndm = NLMSG_DATA(nlh);
+	neigh_info_t ni;
+	fabric_link_t *fl;
+
+	/* Without strict checking, an FDB dump may cover every device. */
+	if (ndm->ndm_ifindex != rc_index ||
+	    (fl = index_to_link(ndm->ndm_ifindex)) == NULL)
+		return;
+	rc_entries++;
+	parse_neigh(nlh, &ni);
+	if (ni.ni_lladdr == NULL || !ni.ni_have_ip)
+		return;
+
+	if (ndm->ndm_family == AF_BRIDGE) {
+		/* Only unicast entries like the ones we write. */
+		if (fl->fl_vxlan != NULL || (ni.ni_lladdr[0] & 1) != 0 ||
+		    !(ndm->ndm_state & NUD_PERMANENT))
+			return;
+		reconcile_fdb(fl, ni.ni_lladdr, ni.ni_vid, ni.ni_tagged,
+		    ni.ni_ip, ni.ni_port);
+	} else {
+		if (!is_fabric_link(fl) ||
+		    (ndm->ndm_state & (NUD_INCOMPLETE | NUD_FAILED)) != 0)
+			return;
+		index_neigh(fl->fl_ifindex, ni.ni_ip, ni.ni_lladdr);
+		reconcile_neigh(fl, ni.ni_ip, ni.ni_lladdr);
+	}
+}
+
+/*
+ * Ask for the next dump of the pass: a fabric link's IPv6 table after its
+ * IPv4 one, else the next link's first.  Returns false when there are no
+ * more.
+ */
+static bool
+next_dump(void)
+{
+	fabric_link_t *fl;
+
+	if (rc_family == AF_INET && index_to_link(rc_index) != NULL) {
+		rc_family = AF_INET6;
+	} else {
+		for (rc_index++; rc_index < linktab_size; rc_index++) {
+			if ((fl = linktab[rc_index]) == NULL)
+				continue;
+			if (fl->fl_vxlan == NULL)
+				rc_family = AF_BRIDGE;
+			else if (is_fabric_link(fl))
+				rc_family = AF_INET;
+			else
+				continue;
+			break;
+		}
+		if (rc_index >= linktab_size)
+			return (false);
+		rc_clean = true;
+	}
+
+	rc_len = rc_off = 0;
+	if (!send_neigh_dump(rc_fd, ++rc_seq, rc_family, rc_index)) {
+		rc_clean = false;
+		rc_incomplete++;
+		return (true);	/* Stay RC_NEXT, and move on. */
+	}
+	rc_state = RC_DUMPING;
+	return (true);
+}
+
+/*
+ * Handle the next message of the current dump, reading more first if need
+ * be.  Returns false if there's nothing to read yet.
+ */
+static bool
+read_dump(void)
+{
+	struct nlmsghdr *nlh;
+	struct nlmsgerr *nle;
+	fabric_link_t *fl;
+	ssize_t len;
+
+	if (rc_off >= rc_len) {
+		len = recv(rc_fd, rc_buf, sizeof (rc_buf), MSG_DONTWAIT);
+		if (len == -1 && (errno == EAGAIN || errno == EINTR))
+			return (false);
+		if (len <= 0) {
+			/* Abandon this dump; what's left of it is ignored. */
+			warn("read_dump(): recv()");
+			rc_clean = false;
+			rc_incomplete++;
+			rc_state = RC_NEXT;
+			return (true);
+		}
+		rc_len = len;
+		rc_off = 0;
+	}
+
+	nlh = (struct nlmsghdr *)(rc_buf + rc_off);
+	if (!NLMSG_OK(nlh, rc_len - rc_off)) {
+		rc_off = rc_len;
+		return (true);
+	}
+	rc_off += NLMSG_ALIGN(nlh->nlmsg_len);
+	if (nlh->nlmsg_seq != rc_seq)
+		return (true);	/* From an abandoned dump */
+	if (nlh->nlmsg_flags & NLM_F_DUMP_INTR)
+		rc_clean = false;	/* Table changed under it */
+
+	switch (nlh->nlmsg_type) {
+	case RTM_NEWNEIGH:
+		reconcile_entry(nlh);
+		break;
+	case NLMSG_ERROR:
+	case NLMSG_DONE:
+		/* A dump that fails part way says so in its NLMSG_DONE. */
+		nle = NLMSG_DATA(nlh);
+		if (nle->error != 0) {
+			warnx("Reconciliation dump of ifindex %d failed: %s",
+			    rc_index, strerror(-nle->error));
+			rc_clean = false;
+			rc_incomplete++;
+			rc_state = RC_NEXT;
+			break;
+		}
+		rc_dumps++;
+		if (rc_family != AF_INET && rc_clean &&
+		    (fl = index_to_link(rc_index)) != NULL)
+			fl->fl_recon = rc_pass;
+		rc_state = RC_NEXT;
+		break;
+	}
+	return (true);
+}
+
+static void
+start_pass(void)
+{
+	if (rc_fd == -1)
+		rc_fd = open_dump_socket();
+	if (++rc_pass == 0)
+		rc_pass = 1;	/* fl_recon starts at 0 */
+	new_shadow_epoch();
+	rc_index = -1;
+	rc_family = AF_UNSPEC;
+	rc_pass_fixed = 0;
+	rc_start_ms = now_ms();
+	rc_state = RC_NEXT;
+}
+
+static void
+finish_pass(void)
+{
+	uint32_t swept = sweep_shadow(rc_dumped);
+
+	rc_swept += swept;
+	rc_passes++;
+	rc_state = RC_IDLE;
+	if (rc_pass_fixed != 0 || swept != 0) {
+		warnx("Reconciliation took %lu ms: %lu kernel entries "
+		    "corrected, %u gone from the kernel",
+		    now_ms() - rc_start_ms, rc_pass_fixed, swept);
+	}
+}
+
+static void
+reconcile_tick(void *arg)
+{
+	uint64_t deadline = now_us() + RC_BUDGET_US;
+
+	begin_link_batch();
+	if (rc_state == RC_IDLE)
+		start_pass();
+	while (now_us() < deadline) {
+		if (rc_state == RC_NEXT && !next_dump()) {
+			finish_pass();
+			break;
+		}
+		if (rc_state == RC_DUMPING && !read_dump())
+			break;
+	}
+	(void) end_link_batch();
+
+	if (rc_state != RC_IDLE) {
+		arm_timer(&rc_timer, RC_TICK_MS);
+	} else {
+		arm_timer(&rc_timer, rc_again ? RC_SOON_MS : RC_INTERVAL_MS);
+		rc_again = false;
+	}
+}
+
+static void
+dump_reconcile_stats(void)
+{
+	warnx("Reconciliation: %lu passes, %lu dumps (%lu incomplete), %lu "
+	    "entries, %lu unknown", rc_passes, rc_dumps, rc_incomplete,
+	    rc_entries, rc_unknown);
+	warnx("Reconciliation: %lu FDB and %lu neighbor entries corrected, "
+	    "%lu shadows swept, %lu event overflows", rc_fdb_fixed,
+	    rc_neigh_fixed, rc_swept, rc_lost_events);
+}
+
+/*
+ * Try and answer an RTM_GETNEIGH from the local cache.  A VL3 hit needs
+ * both the IP->MAC and the MAC->underlay halves.  Returns false on a miss,
+ * in which case the caller asks Portolan.
+ *
+ * For a neighbor we've programmed before that is now in doubt (PROBE or
+ * STALE), "revalidate" is set: re-program whatever we last knew, even if
+ * its TTL is up, so traffic keeps flowing, and have svp.c check it with
+ * Portolan in the background.
+ */
+static bool
+answer_l3_from_cache(int32_t index, uint8_t af, const uint8_t *ip,
+    bool revalidate)
+{
+	fabric_link_t *link = index_to_link(index);
+	uint8_t mac[ETHERADDRL], uip[16];
+	uint16_t uport;
+
+	if (link == NULL || link->fl_vxlan == NULL)
+		return (false);	/* Let send_l3_req() complain. */
+	if (!find_vl3_mapping(link->fl_vxlan->fl_id, ip, mac, revalidate) ||
+	    !find_vl2_mapping(link->fl_vxlan->fl_id, mac, uip, &uport,
+	    revalidate))
+		return (false);
+
+	program_vl3(link, ip, mac, uip, uport);
+	if (revalidate)
+		revalidate_l3_req(index, af, ip, mac, uip, uport);
+	return (true);
+}
+
+static bool
+answer_l2_from_cache(int32_t index, const uint8_t *mac)
+{
+	fabric_link_t *link = index_to_link(index);
+	uint8_t uip[16];
+	uint16_t uport;
+
+	if (link == NULL || link->fl_vxlan != NULL)
+		return (false);
+	if (!find_vl2_mapping(link->fl_id, mac, uip, &uport, false))
+		return (false);
+
+	program_vl2(link, mac, uip, uport);
+	return (true);
+}
+
+int
+new_netlink(void)
+{
+	struct sockaddr_nl kernel_nladdr = {
+	    .nl_family = AF_NETLINK,
+	    .nl_groups = (RTMGRP_LINK | RTMGRP_IPV4_ROUTE | RTMGRP_NEIGH),
+	    .nl_pid = getpid()
+	};
+	int netlink_fd;
+
+	/*
+	 * NETLINK_ROUTE with the above RTMGRP_* flags should be sufficient to
+	 * get everything we need.
+	 */
+	netlink_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (netlink_fd == -1) {
+		warnx("socket(AF_NETLINK)");
+		return (-1);
+	}
+
+	if (bind(netlink_fd, (struct sockaddr *)&kernel_nladdr,
+	    sizeof (kernel_nladdr)) != -1) {
+		return (netlink_fd);
+	} else
+		err(-1, "bind()");
+
+	/* Should never reach... */
+	(void) close(netlink_fd);
+	return (-1);
+}
+
+/*
+ * Extract ONE message from netlink.
+ */
+void
+handle_netlink_inbound(int netlink_fd)
+{
+	uint8_t buf[4096];
+	uint8_t *readspot = buf, *endspot;
+	struct nlmsghdr *nlmsg = (struct nlmsghdr *)readspot;
+	struct ifinfomsg *ifi;
+	struct ndmsg *ndm;
+	/* XXX KEBE ASKS overkill? Need we worry about more than one? */
+	struct rtattr *rtas[RTA_MAX] = { NULL };
+	ssize_t recvsize;
+	bool revalidate;
+
+	/*
+	 * We read this in all at once, since it's a kernel-originated
+	 * datagram.
+	 */
+	recvsize = recv(netlink_fd, readspot, sizeof (buf), 0);
+	if (recvsize == -1 && errno == ENOBUFS) {
+		/* Events were lost; a reconciliation pass finds out what. */
+		warnx("Netlink events lost to overflow, reconciling");
+		rc_lost_events++;
+		schedule_reconcile(RC_SOON_MS);
+		return;
+	}
+	if (recvsize == -1)
+		errx(-7, "recv(netlink)");
+
+	if (recvsize != nlmsg->nlmsg_len) {
+		warn("DANGER: recvsize %ld != nlmsg_len %d, "
+		    "dropping...\n", recvsize, nlmsg->nlmsg_len);
+		/* Continue for now... */
+	}
+	endspot = readspot;
+	if (recvsize <= nlmsg->nlmsg_len)
+		endspot += recvsize;
+	else
+		endspot += nlmsg->nlmsg_len;
+
+	/*
+	 * Right now we really only care about two kinds of messages:
+	 * RTM_GETNEIGH and RTM_NEWNEIGH. RTM_NEWNEIGH indicates failure
+	 * but keep listening for it just in case (including perhaps a
+	 * neighbor going stale).
+	 */
+	switch (nlmsg->nlmsg_type) {
+	case RTM_GETNEIGH:
+		ndm = (struct ndmsg *)(nlmsg + 1);
+
+		/*
+		 * Index without state will be handled gracefully
+		 * later. Meanwhile, reality check other ndm fields.
+		 */
+
+		/* Only cope with these address requests... */
+		if (ndm->ndm_family != AF_INET && ndm->ndm_family != AF_INET6 &&
+		    ndm->ndm_family != AF_PACKET) {
+			warn("Unkown ndm_family %d", ndm->ndm_family);
+			return;
+		}
+		/*
+		 * Trigger SVP requests for incomplete, probe, and stale.  The
+		 * latter two are neighbors we've (probably) answered before,
+		 * so answer them from cache at once and revalidate behind.
+		 * XXX KEBE SAYS need to handle failures on both better.
+		 */
+		if (ndm->ndm_state != NUD_INCOMPLETE &&
+		    ndm->ndm_state != NUD_PROBE &&
+		    ndm->ndm_state != NUD_STALE) {
+			warn("Unknown ndm_state 0x%x", ndm->ndm_state);
+			return;
+		}
+		revalidate = (ndm->ndm_state != NUD_INCOMPLETE);
+		/* Right now assume NDA_DST is our only trigger. */
+		if (ndm->ndm_type != NDA_DST) {
+			/* Handle better? */
+			warn("Unknown ndm_type 0x%x\n", ndm->ndm_type);
+			return;
+		}
+		/* XXX KEBE ASKS WTF are the flags for?!? */
+
+		/* Anyway, on to parsing the extensions. */
+		readspot += sizeof (*nlmsg) + sizeof (*ndm);
+		while (readspot < endspot) {
+			struct rtattr *thisone = (struct rtattr *)readspot;
+
+			rtas[thisone->rta_type] = thisone;
+			readspot += RTA_ALIGN(thisone->rta_len);
+		}
+
+		/*
+		 * Alright, I expect:
+		 * - NDA_DST, a destination address (raw, use ndm_family above
+		 *   for type)
+		 * - NDA_CACHEINFO, stats on entries I don't need immediately.
+		 * - NDA_PROBES, number of probes or probe number sent?!?
+		 *
+		 * Really I only need the NDA_DST to construct a portolan
+		 * request.  Do the delayed ndm_family check here as well.
+		 *
+		 * We *do* need a way to convery the ifindex to a vnetid for
+		 * SVP, but we let the SVP functions handle that themselves.
+		 *
+		 * The kernel asking at all means it lacks what we may think
+		 * we gave it, so drop any shadow first, or the answer could
+		 * be elided.
+		 */
+		switch (ndm->ndm_family) {
+		case AF_INET: {
+			struct in6_addr v6addr;
+
+			/* Uggh, SVP requires v4mapped... do it here. */
+			IN6_INADDR_TO_V4MAPPED(
+			    (struct in_addr *)RTA_DATA(rtas[RTA_DST]), &v6addr);
+			remove_neigh_shadow(ndm->ndm_ifindex, v6addr.s6_addr);
+			if (answer_l3_from_cache(ndm->ndm_ifindex, AF_INET,
+			    v6addr.s6_addr, revalidate))
+				break;
+			warn("Sending l3 req");
+			send_l3_req(ndm->ndm_ifindex, AF_INET, v6addr.s6_addr);
+			break;
+		}
+		case AF_INET6:
+			remove_neigh_shadow(ndm->ndm_ifindex,
+			    RTA_DATA(rtas[RTA_DST]));
+			if (answer_l3_from_cache(ndm->ndm_ifindex, AF_INET6,
+			    RTA_DATA(rtas[RTA_DST]), revalidate))
+				break;
+			warn("Sending l3 req (v6)");
+			send_l3_req(ndm->ndm_ifindex, AF_INET6,
+			    RTA_DATA(rtas[RTA_DST]));
+			break;
+		case AF_PACKET: {
+			uint64_t arg = 0;
+
+			forget_fdb_shadows(ndm->ndm_ifindex,
+			    RTA_DATA(rtas[RTA_DST]));
+			if (answer_l2_from_cache(ndm->ndm_ifindex,
+			    RTA_DATA(rtas[RTA_DST])))
+				break;
+			warn("Sending l2 req");
+			memcpy(&arg, RTA_DATA(rtas[RTA_DST]), ETHERADDRL);
+			/* Cheesy use of 64-bit ints for MAC. */
+			send_l2_req(ndm->ndm_ifindex, arg);
+			break;
+		}
+		default:
+			/* Handle better? */
+			warn("Unknown ndm_family %d\n", ndm->ndm_family);
+		}
+		break;
+	case RTM_NEWNEIGH:
+		/* Only a demotion to STALE matters; see watch_neighbor(). */
+		ndm = (struct ndmsg *)(nlmsg + 1);
+		if (ndm->ndm_state != NUD_STALE ||
+		    (ndm->ndm_family != AF_INET &&
+		    ndm->ndm_family != AF_INET6))
+			break;
+		readspot += sizeof (*nlmsg) + sizeof (*ndm);
+		while (readspot < endspot) {
+			struct rtattr *thisone = (struct rtattr *)readspot;
+
+			if (thisone->rta_type == NDA_DST) {
+				struct in6_addr v6addr;
+
+				if (ndm->ndm_family == AF_INET) {
+					IN6_INADDR_TO_V4MAPPED(
+					    (struct in_addr *)RTA_DATA(thisone),
+					    &v6addr);
+				} else {
+					(void) memcpy(&v6addr,
+					    RTA_DATA(thisone), 16);
+				}
+				watch_neighbor(ndm->ndm_ifindex,
+				    v6addr.s6_addr);
+				break;
+			}
+			readspot += RTA_ALIGN(thisone->rta_len);
+		}
+		break;
+	case RTM_DELNEIGH:
+		/* Garbage collected, flushed by hand, or our own delete. */
+		forget_neigh(nlmsg);
 		break;
 	case RTM_DELLINK:
 		/*
@@ -513,9 +2303,7 @@ handle_netlink_inbound(int netlink_fd)
 		 */
 		ifi = (struct ifinfomsg *)(nlmsg + 1);
 		warn("Deleting & freeing ifindex %d", ifi->ifi_index);
-		/* Even if NULL, free(NULL) will work. */
-		free(linktab[ifi->ifi_index]);
-		linktab[ifi->ifi_index] = NULL;
+		remove_link_entry(ifi->ifi_index);
 		break;
 	case RTM_NEWLINK:
  		/* If the ifi_change is all 1s, it's an actual new link. */
@@ -12,6 +12,7 @@
 #define	_LINK_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,17 +21,43 @@ extern "C" {
 /* Because *^#@$-ing glibc. */
 extern size_t strlcpy(char *, const char *, size_t);
 
+/*
+ * Besides linktab[] (by ifindex), links are indexed by vnet: vxlan links
+ * hash on vnetid (fl_vnext), and each keeps its vlan and fabric links on
+ * fl_children/fl_sibling.  See vnet_to_link().
+ */
 typedef struct fabric_link_s {
 	struct fabric_link_s *fl_vxlan;	/* Points to vlan's vxlan if a vlan. */
 	char fl_name[16];		/* Name, Linux-capped at 15 + '\0' */
 	int32_t fl_ifindex;		/* Linux interface index */
 	uint32_t fl_id;			/* VID if vlan, vnetid if vxlan */
+	struct fabric_link_s *fl_vnext;		/* vxlan: vnet hash chain */
+	struct fabric_link_s *fl_children;	/* vxlan: vlan/fabric links */
+	struct fabric_link_s *fl_sibling;	/* vlan/fabric: next child */
+	uint32_t fl_recon;		/* Last reconciliation fully dumped */
+	uint64_t fl_write_failures;	/* Kernel updates that failed */
 } fabric_link_t;
 
 extern void scan_triton_fabrics(const char *, int32_t);
 extern int new_netlink(void);
 extern void handle_netlink_inbound(int);
 extern fabric_link_t *index_to_link(int32_t);
+extern fabric_link_t *vnet_to_link(uint32_t);
+extern uint32_t find_fabric_links(uint32_t, uint32_t, fabric_link_t **,
+    uint32_t);
+extern void program_vl3(fabric_link_t *, const uint8_t *, const uint8_t *,
+    const uint8_t *, uint16_t);
+extern void program_vl2(fabric_link_t *, const uint8_t *, const uint8_t *,
+    uint16_t);
+extern void unprogram_vl3(fabric_link_t *, const uint8_t *);
+extern void unprogram_vl2(fabric_link_t *, const uint8_t *);
+extern uint32_t shootdown_vl2(fabric_link_t *, const uint8_t *);
+extern void set_link_origin(uint32_t);
+extern void begin_link_batch(void);
+extern uint64_t end_link_batch(void);
+extern void dump_link_stats(void);
+extern int link_update_fd(void);
+extern void handle_link_acks(void);
 
 #ifdef __cplusplus
 }
@@ -17,12 +17,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <poll.h>
+#include <time.h>
 
 #include "svp.h"
 #include "link.h"
+#include "timer.h"
+#include "cache.h"
+#include "crc.h"
+#include "pool.h"
 
 #define	SVP_PORT 1296	/* Should be in svp.h or its includes... */
 
+/* Cap on outstanding SVP transactions, can be overridden by `-t`. */
+#define	DEFAULT_MAX_OUTSTANDING	8192
+
+/* New lookups held while Portolan is unreachable (`-q`). */
+#define	DEFAULT_MAX_QUEUED	1024
+
+/*
+ * Hedging: percent of requests that may be hedged (`-H`, 0 is off), and
+ * the RTT percentile after which a request is hedged (`-P`).
+ */
+#define	DEFAULT_HEDGE_BUDGET	0
+#define	DEFAULT_HEDGE_PCTILE	95
+
+/* Per-table mapping cache entries (`-c`) and TTL in seconds (`-T`). */
+#define	DEFAULT_CACHE_ENTRIES	32768
+#define	DEFAULT_CACHE_TTL	300
+
+/* Negative (SVP_S_NOTFOUND) cache slots (`-N`) and TTL in seconds (`-n`). */
+#define	DEFAULT_NEG_ENTRIES	(1 << 20)
+#define	DEFAULT_NEG_TTL		10
+
 /* Can be overridden by `-f $FILE` argument... */
 char *nicfile = "/var/varpd/fabric-nics.txt";
 
@@ -30,7 +56,12 @@ static int
 usage(const char *prog)
 {
 	(void) fprintf(stderr,
-	    "Usage:  %s -a server-addr [-f FILE] [-p port] \n", prog);
+	    "Usage:  %s -a server-addr [-a server-addr]... [-f FILE] "
+	    "[-p port]\n\t[-t max-outstanding] [-q max-queued] "
+	    "[-c cache-entries] [-T cache-ttl]\n\t[-N neg-cache-entries] "
+	    "[-n neg-cache-ttl] [-H hedge-pct] [-P hedge-percentile]\n\t"
+	    "[-u underlay-addr] [-b]\n",
+	    prog);
 	exit(1);
 }
 
@@ -42,21 +73,42 @@ do_sighup(int sig)
 	if (sig != SIGHUP)
 		errx(-1, "WTF signal-handler?!?\n");
 
-	if (processed_sighup)
-		warn("do_sighup() again entered before we cleared things\n");
-
-	scan_triton_fabrics(NULL, 0);
+	/*
+	 * Just flag it; the main loop rescans outside signal context, as the
+	 * rescan allocates links and arms timers it may be in the middle of.
+	 */
 	processed_sighup = true;
 }
 
+static bool processed_sigusr1;
+
+static void
+do_sigusr1(int sig)
+{
+	/* Just flag it, the main loop dumps stats outside signal context. */
+	processed_sigusr1 = true;
+}
+
 /* Keep this global... */
-int svp_fd, netlink_fd;
+int netlink_fd;
 
 int
 main(int argc, char *argv[])
 {
 	uint16_t newport;
+	long max_outstanding = DEFAULT_MAX_OUTSTANDING;
+	long max_queued = DEFAULT_MAX_QUEUED;
+	long hedge_budget = DEFAULT_HEDGE_BUDGET;
+	long hedge_pctile = DEFAULT_HEDGE_PCTILE;
+	long cache_entries = DEFAULT_CACHE_ENTRIES;
+	long cache_ttl = DEFAULT_CACHE_TTL;
+	long neg_entries = DEFAULT_NEG_ENTRIES;
+	long neg_ttl = DEFAULT_NEG_TTL;
 	int optchar, pollrc;
+	uint32_t i, naddrs = 0;
+	struct in_addr svp_addrs[SVP_MAX_SERVERS];
+	struct in_addr underlay = { INADDR_ANY };
+	bool bulk = false;
 	struct sockaddr_in svp_sin = {
 		.sin_family = AF_INET,
 		.sin_port = htons(SVP_PORT),
@@ -65,9 +117,13 @@ main(int argc, char *argv[])
 		.sa_handler = do_sighup,
 		
 	};
-	struct pollfd fds[2];
+	struct sigaction usr1act = {
+		.sa_handler = do_sigusr1,
+	};
+	struct pollfd fds[2 + SVP_MAX_SERVERS];
 
-	while ((optchar = getopt(argc, argv, "f:p:a:")) != EOF) {
+	while ((optchar = getopt(argc, argv, "f:p:a:t:q:c:T:N:n:H:P:u:b")) !=
+	    EOF) {
 		switch (optchar) {
 		case 'f':
 			nicfile = optarg; /* XXX KEBE ASKS strdup() ? */
@@ -81,30 +137,120 @@ main(int argc, char *argv[])
 			svp_sin.sin_port = htons(newport);
 			break;
 		case 'a':
-			if (!inet_aton(optarg, &svp_sin.sin_addr)) {
+			if (naddrs == SVP_MAX_SERVERS) {
+				warnx("Too many -a, max %u", SVP_MAX_SERVERS);
+				usage(argv[0]);
+			}
+			if (!inet_aton(optarg, &svp_addrs[naddrs]) ||
+			    svp_addrs[naddrs].s_addr == INADDR_ANY) {
 				warnx("Invalid address: %s", optarg);
 				usage(argv[0]);
 			}
+			naddrs++;
+			break;
+		case 't':
+			max_outstanding = atol(optarg);
+			if (max_outstanding <= 0 ||
+			    max_outstanding > 0x10000000) {
+				warnx("bad max-outstanding value");
+				usage(argv[0]);
+			}
+			break;
+		case 'q':
+			max_queued = atol(optarg);
+			if (max_queued < 0 || max_queued > 0x10000000) {
+				warnx("bad max-queued value");
+				usage(argv[0]);
+			}
+			break;
+		case 'c':
+			cache_entries = atol(optarg);
+			if (cache_entries <= 0 || cache_entries > 0x10000000) {
+				warnx("bad cache-entries value");
+				usage(argv[0]);
+			}
+			break;
+		case 'T':
+			cache_ttl = atol(optarg);
+			if (cache_ttl <= 0 || cache_ttl > 86400) {
+				warnx("bad cache-ttl value");
+				usage(argv[0]);
+			}
+			break;
+		case 'N':
+			neg_entries = atol(optarg);
+			if (neg_entries <= 0 || neg_entries > 0x40000000) {
+				warnx("bad neg-cache-entries value");
+				usage(argv[0]);
+			}
+			break;
+		case 'n':
+			neg_ttl = atol(optarg);
+			if (neg_ttl <= 0 || neg_ttl > 3600) {
+				warnx("bad neg-cache-ttl value");
+				usage(argv[0]);
+			}
+			break;
+		case 'H':
+			hedge_budget = atol(optarg);
+			if (hedge_budget < 0 || hedge_budget > 100) {
+				warnx("bad hedge-pct value");
+				usage(argv[0]);
+			}
+			break;
+		case 'P':
+			hedge_pctile = atol(optarg);
+			if (hedge_pctile < 50 || hedge_pctile > 99) {
+				warnx("bad hedge-percentile value");
+				usage(argv[0]);
+			}
+			break;
+		case 'u':
+			if (!inet_aton(optarg, &underlay) ||
+			    underlay.s_addr == INADDR_ANY) {
+				warnx("Invalid underlay address: %s", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case 'b':
+			bulk = true;
 			break;
 		default:
 			return (usage(argv[0]));
 		}
 	}
 
-	if (svp_sin.sin_addr.s_addr == INADDR_ANY) {
+	if (naddrs == 0) {
 		warnx("Needs -a <addr>");
 		usage(argv[0]);
 	}
 
+	srandom((unsigned int)(getpid() ^ time(NULL)));
+	init_timers();
+	init_crc();
+	/* Before the scan, which asks for a preload per vnet it finds. */
+	if (bulk)
+		init_svp_bulk();
 	scan_triton_fabrics(NULL, 0);
+	init_transactions((uint32_t)max_outstanding, (uint32_t)max_queued);
+	init_hedging((uint32_t)hedge_budget, (uint32_t)hedge_pctile);
+	init_cache((uint32_t)cache_entries, (uint32_t)cache_ttl);
+	init_negative_cache((uint32_t)neg_entries, (uint32_t)neg_ttl);
 
 	/*
-	 * Because of multiple failure modes, new_svp() will print
-	 * diagnostics.
+	 * This only starts connecting; svp_conn.c reports on (and retries)
+	 * its progress from the event loop.  All servers share the port.
 	 */
-	svp_fd = new_svp(&svp_sin);
-	if (svp_fd == -1)
-		errx(-3, "SVP server failure. ");
+	for (i = 0; i < naddrs; i++) {
+		svp_sin.sin_addr = svp_addrs[i];
+		add_svp_server(&svp_sin);
+	}
+
+	/* Portolan keys our change log on our underlay address. */
+	if (underlay.s_addr != INADDR_ANY)
+		init_log_sync(&underlay);
+	else
+		warnx("No -u underlay-addr, not following the change log");
 
 	/*
 	 * Because of multiple failure modes, netlink_fd() will print
@@ -117,22 +263,44 @@ main(int argc, char *argv[])
 	/* Set up HUP handler... */
 	if (sigaction(SIGHUP, &sigact, NULL) == -1)
 		err(-2, "sigaction(): ");
+	if (sigaction(SIGUSR1, &usr1act, NULL) == -1)
+		err(-2, "sigaction(SIGUSR1): ");
 
-	/* Build poll() loop here on netlink_fd and svp_fd. */
-	fds[0].fd = svp_fd;
+	/*
+	 * Build poll() loop here on netlink_fd, the kernel update socket's
+	 * ACKs, and the SVP servers.
+	 */
+	fds[0].fd = netlink_fd;
 	fds[0].events = POLLIN;
 	fds[0].revents = 0;
-	fds[1].fd = netlink_fd;
 	fds[1].events = POLLIN;
-	fds[1].revents = 0;
 	do {
-		pollrc = poll(fds, 2, 60);	/* 60sec timeout? */
+		/* These come and go; -1 makes poll() skip them. */
+		fds[1].fd = link_update_fd();
+		fds[1].revents = 0;
+		for (i = 0; i < svp_npool; i++) {
+			fds[2 + i].fd = svp_pool[i]->sc_fd;
+			fds[2 + i].events = svp_conn_events(svp_pool[i]);
+			fds[2 + i].revents = 0;
+		}
+		/* Sleep until the next timer is due, or forever if none. */
+		pollrc = poll(fds, 2 + svp_npool, next_timer_timeout());
 		/* Treat 0 as nothing's wrong... */
 		if (pollrc < 0 && errno == EINTR) {
-			if (processed_sighup) {
+			if (processed_sighup || processed_sigusr1) {
 				/* Clear errno... */
 				errno = 0;
-				processed_sighup = false;
+				if (processed_sighup) {
+					processed_sighup = false;
+					scan_triton_fabrics(NULL, 0);
+				}
+				if (processed_sigusr1) {
+					processed_sigusr1 = false;
+					dump_svp_stats();
+					dump_cache_stats();
+					dump_pool_stats();
+					dump_link_stats();
+				}
 				pollrc = 0; /* Keep looping! */
 			} else {
 				/*
@@ -143,17 +311,29 @@ main(int argc, char *argv[])
 			}
 			continue;	/* Will hit while-end and stop if -1. */
 		}
-		/* svp_fd */
-		if (fds[0].revents != 0) {
-			handle_svp_inbound(svp_fd);
-			fds[0].revents = 0;
-		}
+		/* Kernel updates from this time around go in one sendmsg(). */
+		begin_link_batch();
+
+		/* SVP servers */
+		for (i = 0; i < svp_npool; i++)
+			handle_svp_events(svp_pool[i], fds[2 + i].revents);
 
 		/* netlink_fd */
-		if (fds[1].revents != 0) {
+		if (fds[0].revents != 0) {
 			handle_netlink_inbound(netlink_fd);
-			fds[1].revents = 0;
+			fds[0].revents = 0;
 		}
+
+		/* Kernel update ACKs */
+		if (fds[1].revents != 0)
+			handle_link_acks();
+
+		run_timers();
+		(void) end_link_batch();
+
+		/* One send() per server for everything queued this time. */
+		for (i = 0; i < svp_npool; i++)
+			flush_svp_conn(svp_pool[i]);
 	} while (pollrc != -1);
 	
 	warnx("poll() failure");
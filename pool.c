@@ -0,0 +1,109 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2023 MNX Cloud, Inc.
+ */
+
+/*
+ * Fixed-size object pools, so what we allocate per lookup and per link
+ * doesn't go through malloc() in a daemon that runs for months.
+ *
+ * Objects come from chunks of vp_chunk at a time, the first allocated by
+ * init_pool(), and go back on a LIFO freelist threaded through the free
+ * objects themselves (so the most recently freed, and likely cache-warm,
+ * one is reused first).  Chunks are never returned to malloc(); a pool is
+ * only ever as big as its high-water mark, rounded up to a chunk.
+ */
+
+#include <err.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define	POOL_ALIGN	16
+
+static varpd_pool_t *all_pools;
+
+static void
+grow_pool(varpd_pool_t *vp)
+{
+	uint8_t *chunk;
+	uint32_t i;
+
+	chunk = calloc(vp->vp_chunk, vp->vp_size);
+	if (chunk == NULL) {
+		errx(-80, "grow_pool(): can't add %u more %s", vp->vp_chunk,
+		    vp->vp_name);
+	}
+	/* Thread the freelist so the chunk is handed out in address order. */
+	for (i = vp->vp_chunk; i > 0; i--) {
+		*(void **)(chunk + (i - 1) * vp->vp_size) = vp->vp_free;
+		vp->vp_free = chunk + (i - 1) * vp->vp_size;
+	}
+	vp->vp_total += vp->vp_chunk;
+	vp->vp_chunks++;
+}
+
+/* Set up "vp" for "size"-byte objects, and preallocate the first chunk. */
+void
+init_pool(varpd_pool_t *vp, const char *name, size_t size, uint32_t chunk)
+{
+	assert(chunk > 0);
+
+	(void) memset(vp, 0, sizeof (*vp));
+	vp->vp_name = name;
+	if (size < sizeof (void *))
+		size = sizeof (void *);
+	vp->vp_size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	vp->vp_chunk = chunk;
+	vp->vp_next = all_pools;
+	all_pools = vp;
+	grow_pool(vp);
+}
+
+/* A zeroed object.  Never fails; running out of memory is fatal. */
+void *
+pool_alloc(varpd_pool_t *vp)
+{
+	void *obj;
+
+	if (vp->vp_free == NULL)
+		grow_pool(vp);
+	obj = vp->vp_free;
+	vp->vp_free = *(void **)obj;
+	(void) memset(obj, 0, vp->vp_size);
+
+	vp->vp_allocs++;
+	if (++vp->vp_inuse > vp->vp_highwater)
+		vp->vp_highwater = vp->vp_inuse;
+	return (obj);
+}
+
+void
+pool_free(varpd_pool_t *vp, void *obj)
+{
+	assert(vp->vp_inuse > 0);
+
+	*(void **)obj = vp->vp_free;
+	vp->vp_free = obj;
+	vp->vp_inuse--;
+}
+
+void
+dump_pool_stats(void)
+{
+	varpd_pool_t *vp;
+
+	for (vp = all_pools; vp != NULL; vp = vp->vp_next) {
+		warnx("Pool %s: %u in use (high-water %u) of %u in %u chunks, "
+		    "%lu bytes each, %lu allocations", vp->vp_name,
+		    vp->vp_inuse, vp->vp_highwater, vp->vp_total,
+		    vp->vp_chunks, vp->vp_size, vp->vp_allocs);
+	}
+}
@@ -0,0 +1,47 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2023 MNX Cloud, Inc.
+ */
+
+#ifndef _POOL_H
+#define	_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A pool of fixed-size objects.  Embed one (statically, usually) and hand
+ * it to init_pool(); the rest is owned by pool.c.
+ */
+typedef struct varpd_pool {
+	const char *vp_name;
+	size_t vp_size;			/* Per object, rounded up */
+	uint32_t vp_chunk;		/* Objects per growth */
+	struct varpd_pool *vp_next;	/* All pools, for dump_pool_stats() */
+	void *vp_free;			/* Linked through the free objects */
+	uint32_t vp_total;		/* Free + in use */
+	uint32_t vp_inuse;
+	uint32_t vp_highwater;
+	uint32_t vp_chunks;
+	uint64_t vp_allocs;
+} varpd_pool_t;
+
+extern void init_pool(varpd_pool_t *, const char *, size_t, uint32_t);
+extern void *pool_alloc(varpd_pool_t *);
+extern void pool_free(varpd_pool_t *, void *);
+extern void dump_pool_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _POOL_H */
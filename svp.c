@@ -19,10 +19,12 @@
 
 #include "link.h"
 #include "svp.h"
-#include "crc32.h"
+#include "crc.h"
+#include "timer.h"
+#include "cache.h"
+#include "pool.h"
 
 static uint32_t our_svp_id = 1;	/* Will never be 0 */
-extern int svp_fd;
 
 typedef union svp_remotereq {
 	svp_req_t svprr_head;
@@ -70,21 +72,54 @@ typedef union svp_remotereq {
 #define	svprr_l2a_port svprr_l2a.l2ack.sl2a_port
 #define	svprr_l2a_ip svprr_l2a.l2ack.sl2a_addr
 
-typedef struct svp_transaction {
-	/* XXX BEGIN LINKAGE XXX */
+/*
+ * Distinct links that can wait on one in-flight lookup.  Past this, later
+ * askers are dropped; the kernel will solicit again anyway.
+ */
+#define	SVPT_MAX_WAITERS	8
 
-	/* Sigh... linux has nothing good like libavl so just list it for now. */
-	struct svp_transaction **svpt_ptpn;  /* Must be first! */
-	struct svp_transaction *svpt_next;
+/*
+ * We don't keep a copy of the request itself; it's re-encoded from the
+ * key straight into the connection's send buffer on every transmission.
+ */
+typedef struct svp_transaction {
+	uint32_t svpt_id;		/* Un-swapped, as on the wire */
+	uint16_t svpt_op;		/* Host order, SVP_R_VL[23]_REQ */
+	svp_lookup_key_t svpt_key;	/* What we're asking, also in-flight */
+	varpd_timer_t svpt_timer;	/* Retry/expiry timer */
+	uint32_t svpt_tries;		/* Transmissions so far */
+	bool svpt_parked;		/* Waiting for a server with room */
+	struct svp_transaction *svpt_park_next;	/* Park FIFO linkage */
+	struct svp_transaction *svpt_park_prev;
+	svp_conn_t *svpt_conn;		/* Where the last try went */
+	uint64_t svpt_sent_us;		/* ...and when */
+	varpd_timer_t svpt_hedge_timer;	/* When to hedge the first try */
+	svp_conn_t *svpt_hedge_conn;	/* Where the hedged copy went */
+	uint64_t svpt_hedge_sent_us;
+	uint32_t svpt_nwaiters;
+	/* ifindexes, not pointers; links can vanish while we wait. */
+	int32_t svpt_waiters[SVPT_MAX_WAITERS];
 
-	/* XXX END LINKAGE XXX */
-	svp_remotereq_t svpt_rr;
-	struct fabric_link_s *svpt_link;
+	/*
+	 * Revalidations (stale-while-revalidate) remember the mapping that
+	 * was already programmed, and which waiters got it, so an unchanged
+	 * answer doesn't touch the kernel again.
+	 */
+	bool svpt_known;
+	uint32_t svpt_known_mask;	/* Bit i == svpt_waiters[i] */
+	uint8_t svpt_known_mac[ETHERADDRL];
+	uint16_t svpt_known_uport;
+	uint8_t svpt_known_uip[16];
 } svp_transaction_t;
-#define	svpt_id svpt_rr.svprr_head.svp_id
-#define	svpt_index svpt_link->fl_id
 
-static uint32_t svp_crc32_tab[] = { CRC32_TABLE };
+/* Ids for everything we send, lookups or not, except PINGs. */
+uint32_t
+new_svp_id(void)
+{
+	if (our_svp_id == 0 || our_svp_id >= SVP_ID_RESERVED)
+		our_svp_id = 1;
+	return (our_svp_id++);
+}
 
 /*
  * Self-conntained return of a complete, but not wire-ready, CRC32 value.
@@ -92,294 +127,877 @@ static uint32_t svp_crc32_tab[] = { CRC32_TABLE };
 uint32_t
 svp_crc(void *pkt, size_t len)
 {
+	assert(((svp_req_t *)pkt)->svp_crc32 == 0);
+
 	/* Use -1 as the initial crc32 value at the beginning. */
-	uint32_t crc_val = -1;
+	return (~crc32_buf(-1U, pkt, len));
+}
 
-	assert(((svp_req_t *)pkt)->svp_crc32 == 0);
+/*
+ * Outstanding transactions live in an open-addressed, linear-probing hash
+ * table keyed on the (un-swapped) svp_id.  The table is allocated once by
+ * init_transactions() at twice the configured cap, so it never exceeds a
+ * 50% load factor, and insert/lookup/remove never allocate.  Removal uses
+ * backward-shift deletion so there are no tombstones to clean up.
+ *
+ * A second, identically-sized table indexes the same transactions by
+ * svp_lookup_key_t, so a repeat miss for something already in flight
+ * attaches to the existing transaction instead of going to the wire.
+ */
+static svp_transaction_t **txn_tab = NULL;
+static svp_transaction_t **inflight_tab = NULL;
+static uint32_t txn_tabshift;		/* 32 - log2(table size) */
+static uint32_t txn_tabmask;		/* table size - 1 */
+static uint32_t txn_count;		/* Outstanding right now. */
+static uint32_t txn_max;		/* Configured cap on txn_count. */
+static uint32_t txn_parked;		/* Of txn_count, waiting for conn. */
+static uint32_t txn_park_max;		/* New ones admitted while parked. */
+static svp_transaction_t *park_head, *park_tail;
+
+/* Transactions themselves come from here, SVP_TXN_CHUNK at a time. */
+#define	SVP_TXN_CHUNK		1024
+static varpd_pool_t txn_pool;
+
+/* Counters, reported by dump_svp_stats(). */
+static uint32_t txn_highwater;
+static uint64_t txn_inserts, txn_cap_hits, txn_unknown_acks;
+static uint64_t txn_vl2_inserts;
+static uint64_t txn_retries, txn_timeouts, txn_bad_status;
+static uint64_t txn_coalesced, txn_waiter_overflows;
+static uint64_t reval_sent, reval_unchanged, reval_changed;
+static uint64_t txn_send_deferred;
+static uint64_t txn_replayed, txn_park_drops, txn_park_expired;
+static uint64_t txn_rerouted;
+static uint64_t hedges_sent, hedge_denied, hedge_wins, hedge_losers;
+static uint64_t brk_trips, brk_rejected;
+static uint64_t shootdowns, shootdown_neighbors;
+
+/*
+ * An unanswered transaction is retransmitted (same svp_id) after
+ * SVP_TXN_TIMEOUT_MS, doubling each time, with jitter so a burst of
+ * misses doesn't retry in lock-step.  After SVP_TXN_MAX_TRIES
+ * transmissions it is dropped.
+ */
+#define	SVP_TXN_TIMEOUT_MS	500
+#define	SVP_TXN_MAX_TRIES	4
+
+/*
+ * When no server is up, or every one that is has reached its concurrency
+ * limit, transactions are parked, in FIFO order, rather than sent.  They
+ * go out as soon as there's somewhere to send them, with a fresh retry
+ * budget.  A parked transaction is only held for SVP_TXN_PARK_MS; past
+ * that, the kernel has long since given up on the neighbor anyway.
+ */
+#define	SVP_TXN_PARK_MS		(10 * 1000)
+
+/*
+ * Circuit breaker.  Outcomes of tries, answered (however) or timed out,
+ * are tallied over SVP_BRK_WINDOW_MS windows.  If at least SVP_BRK_MIN
+ * tries in a window saw SVP_BRK_FAIL_PCT% or more time out, the pool is
+ * in trouble beyond what ejecting single servers can fix, and the breaker
+ * opens: new lookups fail fast, leaving a brief negative-cache entry so
+ * the kernel's re-solicits don't come straight back.  After brk_open_ms
+ * it half-opens and lets SVP_BRK_PROBES lookups through.  If they're all
+ * answered it closes; if one times out it re-opens for twice as long, up
+ * to SVP_BRK_OPEN_MAX_MS.  Probes that never report (dropped, coalesced)
+ * are re-issued after SVP_BRK_PROBE_MS.
+ */
+#define	SVP_BRK_WINDOW_MS	1000
+#define	SVP_BRK_MIN		20
+#define	SVP_BRK_FAIL_PCT	50
+#define	SVP_BRK_PROBES		5
+#define	SVP_BRK_PROBE_MS	(5 * 1000)
+#define	SVP_BRK_OPEN_MIN_MS	1000
+#define	SVP_BRK_OPEN_MAX_MS	(30 * 1000)
+#define	SVP_BRK_NEG_TTL		2	/* Seconds */
+
+typedef enum svp_brk_state {
+	SVP_BRK_CLOSED = 0,
+	SVP_BRK_OPEN,
+	SVP_BRK_HALF_OPEN
+} svp_brk_state_t;
+
+static svp_brk_state_t brk_state;
+static uint64_t brk_until;		/* now_ms() to half-open/re-probe */
+static uint64_t brk_open_ms;		/* Length of the current opening */
+static uint64_t brk_win_start;
+static uint32_t brk_win_tries, brk_win_fails;
+static uint32_t brk_probes, brk_probes_ok;
+
+/*
+ * Hedging, off unless init_hedging() says otherwise.  A first try still
+ * unanswered after the hedge_percentile'th percentile of recent RTTs is
+ * also sent to a second server.  Each first try earns hedge_budget_pct
+ * hundredths of a hedge, each hedge spends a whole one, and at most
+ * SVP_HEDGE_BURST can be banked; so hedges are capped at that percentage
+ * of traffic.  The last SVP_HEDGE_IDS hedged ids are remembered so the
+ * losing answer can be quietly ignored.
+ */
+#define	SVP_HEDGE_BURST		10
+#define	SVP_HEDGE_IDS		256
+
+static uint32_t hedge_budget_pct;
+static uint32_t hedge_percentile;
+static uint32_t hedge_tokens;
+static uint32_t hedged_ids[SVP_HEDGE_IDS];
+static uint32_t hedged_ids_next;
+
+/* Fibonacci hashing; svp_ids are sequential so this spreads them nicely. */
+#define	TXN_SLOT(id)	(((uint32_t)(id) * 2654435769U) >> txn_tabshift)
+
+static uint32_t
+key_slot(const svp_lookup_key_t *key)
+{
+	uint64_t w[3], h;
+
+	memcpy(w, key, sizeof (w));
+	h = (w[0] ^ w[1]) * 0x9E3779B97F4A7C15ULL;
+	h = (h ^ (h >> 29) ^ w[2]) * 0xBF58476D1CE4E5B9ULL;
+	return ((uint32_t)(h >> 32) >> txn_tabshift);
+}
 
-	CRC32(crc_val, (uint8_t *)pkt, len, crc_val, svp_crc32_tab);
-	return (~crc_val);
+static uint32_t
+id_home(const svp_transaction_t *svpt)
+{
+	return (TXN_SLOT(svpt->svpt_id));
 }
 
-svp_transaction_t *transaction_head = NULL, *transaction_tail = NULL;
+static uint32_t
+key_home(const svp_transaction_t *svpt)
+{
+	return (key_slot(&svpt->svpt_key));
+}
 
-/* Tail insert for now. */
-static void
+/*
+ * "max" caps outstanding transactions, "park_max" caps how many new ones
+ * we'll queue up while the connection is down.
+ */
+void
+init_transactions(uint32_t max, uint32_t park_max)
+{
+	uint32_t size = 2, bits = 1;
+
+	if (max == 0)
+		errx(-10, "init_transactions(): cap must be nonzero");
+
+	while (size < max * 2 && bits < 31) {
+		size <<= 1;
+		bits++;
+	}
+
+	txn_tab = calloc(size, sizeof (svp_transaction_t *));
+	inflight_tab = calloc(size, sizeof (svp_transaction_t *));
+	if (txn_tab == NULL || inflight_tab == NULL)
+		errx(-10, "init_transactions(): allocation failed");
+	txn_tabshift = 32 - bits;
+	txn_tabmask = size - 1;
+	txn_max = max;
+	txn_count = 0;
+	txn_park_max = park_max;
+	txn_parked = 0;
+	init_pool(&txn_pool, "transactions", sizeof (svp_transaction_t),
+	    max < SVP_TXN_CHUNK ? max : SVP_TXN_CHUNK);
+}
+
+/* Hedge up to "budget_pct" percent of requests, at the "pct"th percentile. */
+void
+init_hedging(uint32_t budget_pct, uint32_t pct)
+{
+	hedge_budget_pct = budget_pct;
+	hedge_percentile = pct;
+}
+
+/* Returns false, and counts it, if we're at the cap. */
+static bool
 insert_transaction(svp_transaction_t *svpt)
 {
-	svpt->svpt_next = NULL;
-	if (transaction_tail == NULL) {
-		assert(transaction_head == NULL);
-		svpt->svpt_ptpn = &transaction_head;
-	} else {
-		transaction_tail->svpt_next = svpt;
-		svpt->svpt_ptpn = &transaction_tail->svpt_next;
+	uint32_t slot;
+
+	assert(txn_tab != NULL);
+	if (txn_count >= txn_max) {
+		txn_cap_hits++;
+		return (false);
+	}
+
+	for (slot = TXN_SLOT(svpt->svpt_id); txn_tab[slot] != NULL;
+	    slot = (slot + 1) & txn_tabmask) {
+		/* svp_ids wrap at 2^32, but the cap keeps them unique. */
+		assert(txn_tab[slot]->svpt_id != svpt->svpt_id);
 	}
-	*(svpt->svpt_ptpn) = svpt;
-	transaction_tail = svpt;
+	txn_tab[slot] = svpt;
+
+	for (slot = key_slot(&svpt->svpt_key); inflight_tab[slot] != NULL;
+	    slot = (slot + 1) & txn_tabmask)
+		;
+	inflight_tab[slot] = svpt;
+
+	txn_inserts++;
+	if (++txn_count > txn_highwater)
+		txn_highwater = txn_count;
+	return (true);
 }
 
 static void
-remove_transaction(svp_transaction_t *svpt)
+remove_slot(svp_transaction_t **tab, uint32_t slot,
+    uint32_t (*home_of)(const svp_transaction_t *))
 {
-	*(svpt->svpt_ptpn) = svpt->svpt_next;
-	if (svpt->svpt_next != NULL) {
-		svpt->svpt_next->svpt_ptpn = svpt->svpt_ptpn;
-		svpt->svpt_next = NULL;
-	} else {
-		/* Removing from the end. */
-		assert(transaction_tail == svpt);
-		if (transaction_head == NULL) {
-			/* Final node out! Cleared by first line already! */
-			transaction_tail = NULL;
-		} else {
-			/* works only if ptpn is first element in struct. */
-			transaction_tail =
-			    (svp_transaction_t *)(&svpt->svpt_ptpn);
+	uint32_t next, home;
+
+	/*
+	 * Backward-shift: pull up any later entry in this probe run whose
+	 * home slot means it would no longer be reachable past the hole.
+	 */
+	for (next = (slot + 1) & txn_tabmask; tab[next] != NULL;
+	    next = (next + 1) & txn_tabmask) {
+		home = home_of(tab[next]);
+		if (((next - home) & txn_tabmask) >=
+		    ((next - slot) & txn_tabmask)) {
+			tab[slot] = tab[next];
+			slot = next;
 		}
 	}
-	svpt->svpt_ptpn = NULL;
+	tab[slot] = NULL;
+}
+
+static svp_transaction_t *
+find_inflight(const svp_lookup_key_t *key)
+{
+	uint32_t slot;
+
+	for (slot = key_slot(key); inflight_tab[slot] != NULL;
+	    slot = (slot + 1) & txn_tabmask) {
+		if (memcmp(&inflight_tab[slot]->svpt_key, key,
+		    sizeof (*key)) == 0)
+			return (inflight_tab[slot]);
+	}
+	return (NULL);
+}
+
+static void
+remove_inflight(svp_transaction_t *svpt)
+{
+	uint32_t slot;
+
+	for (slot = key_slot(&svpt->svpt_key); inflight_tab[slot] != svpt;
+	    slot = (slot + 1) & txn_tabmask)
+		assert(inflight_tab[slot] != NULL);
+	remove_slot(inflight_tab, slot, key_home);
 }
 
-/* Remove from list before we return. Match on un-swapped ID. */
+/* Remove from tables before we return. Match on un-swapped ID. */
 static svp_transaction_t *
 find_transaction(uint32_t svp_id)
 {
 	svp_transaction_t *svpt;
+	uint32_t slot;
 
-	for (svpt = transaction_head; svpt != NULL; svpt = svpt->svpt_next) {
-		if (svpt->svpt_id == svp_id)
-			break;
+	for (slot = TXN_SLOT(svp_id); txn_tab[slot] != NULL;
+	    slot = (slot + 1) & txn_tabmask) {
+		if (txn_tab[slot]->svpt_id == svp_id) {
+			svpt = txn_tab[slot];
+			remove_slot(txn_tab, slot, id_home);
+			remove_inflight(svpt);
+			txn_count--;
+			return (svpt);
+		}
+	}
+
+	txn_unknown_acks++;
+	return (NULL);
+}
+
+/*
+ * Attach "ifindex" as a waiter.  Returns false (and counts it) if the
+ * transaction already has as many distinct waiters as it can hold.
+ */
+static bool
+add_waiter(svp_transaction_t *svpt, int32_t ifindex)
+{
+	uint32_t i;
+
+	for (i = 0; i < svpt->svpt_nwaiters; i++) {
+		if (svpt->svpt_waiters[i] == ifindex)
+			return (true);
+	}
+	if (svpt->svpt_nwaiters == SVPT_MAX_WAITERS) {
+		txn_waiter_overflows++;
+		return (false);
 	}
+	svpt->svpt_waiters[svpt->svpt_nwaiters++] = ifindex;
+	return (true);
+}
+
+void
+dump_svp_stats(void)
+{
+	warnx("SVP transactions: %u outstanding (cap %u, high-water %u), "
+	    "%lu issued (%lu VL2), %lu refused at cap, %lu unmatched acks",
+	    txn_count, txn_max, txn_highwater, txn_inserts, txn_vl2_inserts,
+	    txn_cap_hits, txn_unknown_acks);
+	warnx("SVP transactions: %lu retransmits, %lu timed out, %lu bad "
+	    "status", txn_retries, txn_timeouts, txn_bad_status);
+	warnx("SVP transactions: %lu misses coalesced in-flight, "
+	    "%lu waiters dropped", txn_coalesced, txn_waiter_overflows);
+	warnx("SVP revalidations: %lu sent, %lu unchanged, %lu changed",
+	    reval_sent, reval_unchanged, reval_changed);
+	warnx("SVP transactions: %lu sends deferred for lack of buffer",
+	    txn_send_deferred);
+	warnx("SVP transactions: %u parked (cap %u), %lu replayed, %lu "
+	    "refused when full, %lu expired while parked", txn_parked,
+	    txn_park_max, txn_replayed, txn_park_drops, txn_park_expired);
+	warnx("SVP breaker: %s, %lu trips, %lu lookups failed fast",
+	    brk_state == SVP_BRK_CLOSED ? "closed" :
+	    (brk_state == SVP_BRK_OPEN ? "open" : "half-open"),
+	    brk_trips, brk_rejected);
+	warnx("SVP transactions: %lu rerouted off failed servers",
+	    txn_rerouted);
+	warnx("SVP hedging: %u%% budget at p%u (now %lu us), %lu sent, %lu "
+	    "over budget, %lu won, %lu late answers ignored",
+	    hedge_budget_pct, hedge_percentile,
+	    svp_rtt_percentile(hedge_percentile), hedges_sent, hedge_denied,
+	    hedge_wins, hedge_losers);
+	warnx("SVP shootdowns: %lu received, %lu neighbors removed",
+	    shootdowns, shootdown_neighbors);
+	warnx("SVP CRC32 engine: %s", crc32_engine());
+	dump_svp_bulk_stats();
+	dump_svp_log_stats();
+	dump_svp_pool_stats();
+}
+
+/* Which server "svpt" was last sent to, if any, for load accounting. */
+static void
+attach_conn(svp_transaction_t *svpt, svp_conn_t *sc)
+{
+	if (svpt->svpt_conn == sc)
+		return;
+	if (svpt->svpt_conn != NULL)
+		svpt->svpt_conn->sc_outstanding--;
+	svpt->svpt_conn = sc;
+	if (sc != NULL)
+		sc->sc_outstanding++;
+}
 
-	if (svpt != NULL)
-		remove_transaction(svpt);
+/* Likewise for the server a hedged copy went to. */
+static void
+attach_hedge_conn(svp_transaction_t *svpt, svp_conn_t *sc)
+{
+	if (svpt->svpt_hedge_conn == sc)
+		return;
+	if (svpt->svpt_hedge_conn != NULL)
+		svpt->svpt_hedge_conn->sc_outstanding--;
+	svpt->svpt_hedge_conn = sc;
+	if (sc != NULL)
+		sc->sc_outstanding++;
+}
 
-	return (svpt);
+static void
+unpark_transaction(svp_transaction_t *svpt)
+{
+	assert(svpt->svpt_parked);
+	if (svpt->svpt_park_prev != NULL)
+		svpt->svpt_park_prev->svpt_park_next = svpt->svpt_park_next;
+	else
+		park_head = svpt->svpt_park_next;
+	if (svpt->svpt_park_next != NULL)
+		svpt->svpt_park_next->svpt_park_prev = svpt->svpt_park_prev;
+	else
+		park_tail = svpt->svpt_park_prev;
+	svpt->svpt_park_next = svpt->svpt_park_prev = NULL;
+	svpt->svpt_parked = false;
+	txn_parked--;
 }
 
-/* XXX KEBE ASKS, put these in link.c ? */
 static void
-set_overlay_mac(uint8_t *mac, uint8_t *addr, char *nicname, uint16_t vid)
+park_transaction(svp_transaction_t *svpt)
 {
-	char buf[1024];
-	char *cmd = buf;
+	attach_conn(svpt, NULL);
+	attach_hedge_conn(svpt, NULL);
+	cancel_timer(&svpt->svpt_hedge_timer);
+	if (svpt->svpt_parked)
+		return;
+	svpt->svpt_parked = true;
+	svpt->svpt_tries = 0;
+	svpt->svpt_park_prev = park_tail;
+	if (park_tail != NULL)
+		park_tail->svpt_park_next = svpt;
+	else
+		park_head = svpt;
+	park_tail = svpt;
+	txn_parked++;
+	arm_timer(&svpt->svpt_timer, SVP_TXN_PARK_MS);
+}
 
-	warn("Setting mac!");
+static bool transmit_transaction(svp_transaction_t *);
 
-	/*
-	 * XXX KEBE SAYS CHEESY SHELL-OUT for now!
-	 */
-	/*
-	 * XXX KEBE SCREAMS:  Dammit you can't do ::ffff:<v4> in the Linux
-	 * fdb dst!!!
-	 */
-	assert(addr[10] == addr[11] && addr[10] == 0xff);
-	/* XXX KEBE ASKS what if vid == 0? */
-	/* Will need root privileges to make this happen. */
-	(void) snprintf(cmd, sizeof (buf), "bridge fdb replace "
-	    "%x:%x:%x:%x:%x:%x dev %s vlan %d dst %d.%d.%d.%d", mac[0], mac[1],
-	    mac[2], mac[3], mac[4], mac[5], nicname, vid, addr[12],  addr[13],
-	    addr[14], addr[15]);
+/*
+ * There may be room now (a server came up, or a transaction finished);
+ * send parked transactions, oldest first, for as long as there is.
+ */
+void
+replay_transactions(void)
+{
+	svp_transaction_t *svpt;
 
-	/* XXX KEBE SAYS here's the cheese. */
-	if (system(cmd) == -1)
-		err(-21, "set_overlay_mac(): system()");
+	while ((svpt = park_head) != NULL && pick_svp_conn(NULL) != NULL) {
+		unpark_transaction(svpt);
+		txn_replayed++;
+		(void) transmit_transaction(svpt);
+	}
 }
 
+/* "svpt" is out of the tables, and done with; let it go. */
 static void
-set_overlay_ip(uint8_t *ip, uint8_t *mac, char *nicname)
+release_transaction(svp_transaction_t *svpt)
+{
+	if (svpt->svpt_parked)
+		unpark_transaction(svpt);
+	cancel_timer(&svpt->svpt_timer);
+	cancel_timer(&svpt->svpt_hedge_timer);
+	attach_conn(svpt, NULL);
+	attach_hedge_conn(svpt, NULL);
+	pool_free(&txn_pool, svpt);
+	/* That may have made room for something parked. */
+	if (park_head != NULL)
+		replay_transactions();
+}
+
+/*
+ * Encode the request for "svpt" directly into sc's send buffer.  It goes
+ * out at the next flush_svp_conn(), along with everything else queued this
+ * time around the event loop.  Returns false if there was no room, or if
+ * flushing to make some reset the connection.
+ */
+static bool
+encode_request(svp_transaction_t *svpt, svp_conn_t *sc)
 {
-	char buf[1024];
-	char *cmd = buf;
+	svp_remotereq_t *svprr;
+	uint64_t mac_and_pad;
+	size_t paylen = (svpt->svpt_op == SVP_R_VL3_REQ) ?
+	    sizeof (svp_vl3_req_t) : sizeof (svp_vl2_req_t);
 
-	warn("Setting IP!");
+	svprr = append_svp_frame(sc, sizeof (svp_req_t) + paylen);
+	if (svprr == NULL)
+		return (false);
+
+	svprr->svprr_ver = htons(SVP_CURRENT_VERSION);
+	svprr->svprr_op = htons(svpt->svpt_op);
+	svprr->svprr_size = htonl(paylen);
+	svprr->svprr_id = svpt->svpt_id;
+	svprr->svprr_crc32 = 0;
+	if (svpt->svpt_op == SVP_R_VL3_REQ) {
+		memcpy(svprr->svprr_l3r_ip, svpt->svpt_key.slk_addr,
+		    sizeof (struct in6_addr));
+		svprr->svprr_l3r_vnetid = htonl(svpt->svpt_key.slk_vnetid);
+		svprr->svprr_l3r_type = (svpt->svpt_key.slk_af == AF_INET6) ?
+		    htonl(SVP_VL3_IPV6) : htonl(SVP_VL3_IP);
+	} else {
+		/* MAC and (zero) pad in one store. */
+		mac_and_pad = 0;
+		memcpy(&mac_and_pad, svpt->svpt_key.slk_addr, ETHERADDRL);
+		svprr->svprr_l2r_macandpad = mac_and_pad;
+		svprr->svprr_l2r_vnetid = htonl(svpt->svpt_key.slk_vnetid);
+	}
+	svprr->svprr_crc32 = htonl(svp_crc(svprr, sizeof (svp_req_t) + paylen));
+	return (true);
+}
+
+/*
+ * On a first transmission, earn hedging budget, and if we know enough
+ * about recent latency, arrange to hedge if the answer is slow.
+ */
+static void
+schedule_hedge(svp_transaction_t *svpt)
+{
+	uint64_t delay_ms;
+
+	if (hedge_budget_pct == 0 || svp_npool < 2)
+		return;
+
+	hedge_tokens += hedge_budget_pct;
+	if (hedge_tokens > SVP_HEDGE_BURST * 100)
+		hedge_tokens = SVP_HEDGE_BURST * 100;
+
+	delay_ms = (svp_rtt_percentile(hedge_percentile) + 999) / 1000;
+	/* No data yet, or the retry will come around first anyway. */
+	if (delay_ms == 0 || delay_ms >= SVP_TXN_TIMEOUT_MS * 3 / 4)
+		return;
+	arm_timer(&svpt->svpt_hedge_timer, delay_ms);
+}
+
+/*
+ * The first try is slower than hedge_percentile of recent answers.  If
+ * the budget allows, send the same svp_id to a second server; whichever
+ * answers first wins, and the other's ack is ignored.
+ */
+static void
+hedge_transaction(void *arg)
+{
+	svp_transaction_t *svpt = arg;
+	svp_conn_t *sc;
+
+	if (svpt->svpt_tries != 1 || svpt->svpt_conn == NULL)
+		return;
+	if (hedge_tokens < 100) {
+		hedge_denied++;
+		return;
+	}
+	sc = pick_svp_conn(svpt->svpt_conn);
+	if (sc == NULL || !encode_request(svpt, sc))
+		return;
+
+	hedge_tokens -= 100;
+	hedges_sent++;
+	attach_hedge_conn(svpt, sc);
+	svpt->svpt_hedge_sent_us = now_us();
+	hedged_ids[hedged_ids_next++ % SVP_HEDGE_IDS] = svpt->svpt_id;
+}
+
+/* Was "svp_id" recently hedged, i.e. is an unmatched ack for it expected? */
+static bool
+was_hedged(uint32_t svp_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < SVP_HEDGE_IDS; i++) {
+		if (hedged_ids[i] == svp_id)
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * Send "svpt" to whichever server pick_svp_conn() likes best.  Returns
+ * false if there was no room, in which case the retry timer will try
+ * again, or if no server is up, in which case it's parked.
+ */
+static bool
+transmit_transaction(svp_transaction_t *svpt)
+{
+	svp_conn_t *sc;
 
 	/*
-	 * XXX KEBE SAYS CHEESY SHELL-OUT for now!
-	 * Eventually "nicname" should be something more tangible like a
-	 * pointer to a vlan struct with things.
-	 */
-	/*
-	 * XXX KEBE SCREAMS:  Dammit you can do ::ffff:<v4> in the Linux
-	 * ip dst, BUT IT DOES NOT TREAT IT AS A REGULAR IPV4!!!
+	 * On a resend, forget any hedge: its server may be picked again (and
+	 * must not be counted twice), and an answer to either copy would no
+	 * longer be an unambiguous RTT sample.
 	 */
-	assert(ip[10] == ip[11] && ip[10] == 0xff);
-	/* Use "nud reachable" so we aren't being permanent, the default. */
-	(void) snprintf(cmd, sizeof (buf), "ip neigh replace %d.%d.%d.%d "
-	    "lladdr %x:%x:%x:%x:%x:%x dev %s nud reachable", ip[12], ip[13],
-	    ip[14], ip[15], mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
-	    (nicname == NULL) ? "vx4385813v4" : nicname);
+	cancel_timer(&svpt->svpt_hedge_timer);
+	attach_hedge_conn(svpt, NULL);
+
+	sc = pick_svp_conn(NULL);
+	if (sc == NULL) {
+		park_transaction(svpt);
+		return (false);
+	}
+
+	svpt->svpt_tries++;
+	arm_timer(&svpt->svpt_timer,
+	    jitter_ms((uint64_t)SVP_TXN_TIMEOUT_MS << (svpt->svpt_tries - 1)));
+	attach_conn(svpt, sc);
+	svpt->svpt_sent_us = now_us();
+
+	if (!encode_request(svpt, sc)) {
+		/*
+		 * If flushing to make room reset the connection, "svpt" has
+		 * already been rerouted along with the rest of sc's load.
+		 */
+		if (sc->sc_state == SVP_CS_UP)
+			txn_send_deferred++;
+		return (false);
+	}
+	if (svpt->svpt_tries == 1)
+		schedule_hedge(svpt);
+	return (true);
+}
+
+/*
+ * "sc" just went down.  Resend what it was carrying to the rest of the
+ * pool, with a fresh retry budget, or park it if there's nowhere to go.
+ * Hedged copies on it are just forgotten; the original is still out.
+ */
+void
+reroute_transactions(svp_conn_t *sc)
+{
+	svp_transaction_t *svpt;
+	uint32_t slot;
 
-	/* XXX KEBE SAYS here's the cheese. */
-	if (system(buf) == -1)
-		err(-21, "set_overlay_ip(): system()");
+	for (slot = 0; slot <= txn_tabmask && sc->sc_outstanding != 0;
+	    slot++) {
+		svpt = txn_tab[slot];
+		if (svpt == NULL)
+			continue;
+		if (svpt->svpt_hedge_conn == sc)
+			attach_hedge_conn(svpt, NULL);
+		if (svpt->svpt_conn != sc)
+			continue;
+		attach_conn(svpt, NULL);
+		svpt->svpt_tries = 0;
+		txn_rerouted++;
+		(void) transmit_transaction(svpt);
+	}
 }
 
-int
-new_svp(struct sockaddr_in *svp_sin)
+static void
+breaker_trip(void)
 {
-	int svp_fd;
-	svp_req_t svp;
-	/* Use -1 as the initial crc32 value at the beginning. */
-	uint32_t crc_holder, crc_val;
-	ssize_t sendrecv_rc;
-
-	/* Open a TCP connection to Triton's "Portolan" SVP service. */
-	svp_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (svp_fd == -1) {
-		warnx("socket(SVP)");
-		return (-1);
-	}
-
-	if (connect(svp_fd, (struct sockaddr *)svp_sin, sizeof (*svp_sin)) ==
-	    -1) {
-		warnx("connect(SVP)");
-		(void) close(svp_fd);
-		return (-1);
-	}
-
-	/* Send an SVP ping message to confirm things. */
-	svp.svp_ver = htons(SVP_CURRENT_VERSION);
-	svp.svp_op = htons(SVP_R_PING);
-	svp.svp_size = 0;
-	svp.svp_id = 0xffffffff;  /* Normal traffic starts at 1... */
-	svp.svp_crc32 = 0;
-	svp.svp_crc32 = htonl(svp_crc(&svp, sizeof (svp)));
-
-	sendrecv_rc = send(svp_fd, &svp, sizeof (svp), 0);
-	if (sendrecv_rc == -1) {
-		warnx("send(SVP PING)");
-		goto fail;
-	}
-	if (sendrecv_rc != sizeof (svp)) {
-		warnx("send(SVP PING) sent %ld bytes not %ld",
-		    sendrecv_rc, sizeof (svp));
-		goto fail;
-	}
-
-	sendrecv_rc = recv(svp_fd, &svp, sizeof (svp), 0);
-	if (sendrecv_rc == -1) {
-		warnx("recv(SVP PING)");
-		goto fail;
-	}
-	if (sendrecv_rc != sizeof (svp)) {
-		warnx("recv(SVP PING) got %ld bytes not %ld",
-		    sendrecv_rc, sizeof (svp));
-		goto fail;
-	}
-
-	crc_holder = ntohl(svp.svp_crc32);
-	svp.svp_crc32 = 0;
-	crc_val = svp_crc(&svp, sizeof (svp));
-	/* For now just reality check the op. */
-	if (crc_holder != crc_val) {
-		warnx("crc mismatch. Wire's == 0x%x, Ours == 0x%x",
-		    crc_holder, crc_val);
-		goto fail;
-	}
-
-	if (svp.svp_op == htons(SVP_R_PONG)) {
-		/* (void) printf("All good to go!\n"); */
-		return (svp_fd);
-	} else {
-		warnx("Message type mismatch, got %d, expected %d",
-		    ntohs(svp.svp_op), SVP_R_PONG);
+	brk_open_ms = (brk_state == SVP_BRK_HALF_OPEN) ?
+	    brk_open_ms * 2 : SVP_BRK_OPEN_MIN_MS;
+	if (brk_open_ms > SVP_BRK_OPEN_MAX_MS)
+		brk_open_ms = SVP_BRK_OPEN_MAX_MS;
+	brk_state = SVP_BRK_OPEN;
+	brk_until = now_ms() + brk_open_ms;
+	brk_trips++;
+	warnx("SVP breaker open for %lu ms", brk_open_ms);
+}
+
+/* A try was answered ("ok"), or timed out. */
+static void
+breaker_note(bool ok)
+{
+	uint64_t now;
+
+	switch (brk_state) {
+	case SVP_BRK_OPEN:
+		return;		/* Stragglers. */
+	case SVP_BRK_HALF_OPEN:
+		if (!ok) {
+			breaker_trip();
+		} else if (++brk_probes_ok >= SVP_BRK_PROBES) {
+			brk_state = SVP_BRK_CLOSED;
+			brk_win_tries = brk_win_fails = 0;
+			warnx("SVP breaker closed");
+		}
+		return;
+	case SVP_BRK_CLOSED:
+		break;
+	}
+
+	now = now_ms();
+	if (now - brk_win_start >= SVP_BRK_WINDOW_MS) {
+		brk_win_start = now;
+		brk_win_tries = brk_win_fails = 0;
+	}
+	brk_win_tries++;
+	if (!ok)
+		brk_win_fails++;
+	if (brk_win_tries >= SVP_BRK_MIN &&
+	    brk_win_fails * 100 >= brk_win_tries * SVP_BRK_FAIL_PCT)
+		breaker_trip();
+}
+
+/* May a new lookup go to Portolan? */
+static bool
+breaker_admit(void)
+{
+	uint64_t now;
+
+	if (brk_state == SVP_BRK_CLOSED)
+		return (true);
+
+	now = now_ms();
+	if (now < brk_until) {
+		if (brk_state == SVP_BRK_OPEN || brk_probes >= SVP_BRK_PROBES)
+			return (false);
+		brk_probes++;
+		return (true);
+	}
+
+	/* Time to (re-)probe. */
+	brk_state = SVP_BRK_HALF_OPEN;
+	brk_until = now + SVP_BRK_PROBE_MS;
+	brk_probes = 1;
+	brk_probes_ok = 0;
+	return (true);
+}
+
+static void
+expire_transaction(void *arg)
+{
+	svp_transaction_t *svpt = arg;
+
+	if (svpt->svpt_parked) {
+		txn_park_expired++;
+		(void) find_transaction(svpt->svpt_id);
+		release_transaction(svpt);
+		return;
+	}
+
+	/* Count it against the server(s) that didn't answer. */
+	breaker_note(false);
+	if (svpt->svpt_conn != NULL)
+		note_svp_timeout(svpt->svpt_conn);
+	if (svpt->svpt_hedge_conn != NULL)
+		note_svp_timeout(svpt->svpt_hedge_conn);
+
+	if (svpt->svpt_tries < SVP_TXN_MAX_TRIES) {
+		txn_retries++;
+		(void) transmit_transaction(svpt);
+		return;
 	}
 
-fail:
-	(void) close(svp_fd);
-	return (-1);
+	warnx("SVP transaction 0x%x timed out after %u tries", svpt->svpt_id,
+	    svpt->svpt_tries);
+	txn_timeouts++;
+	(void) find_transaction(svpt->svpt_id);
+	release_transaction(svpt);
 }
 
-/* Assuming input is off the wire. May want transaction too... */
+/*
+ * Status is host-order; VL2 and VL3 acks have different-width status
+ * fields.  The transaction is the one being answered, and "sc" the server
+ * answering it.
+ */
 static bool
-status_check(uint32_t wire_status)
+status_check(uint32_t status, svp_transaction_t *svpt, svp_conn_t *sc)
 {
-	switch (ntohl(wire_status)) {
+	switch (status) {
 	case SVP_S_FATAL:
-		err(-19, "SVP server returned SVP_S_FATAL. Aborting.");
+		breaker_note(false);
+		/*
+		 * Whatever's wrong is Portolan's problem, not ours.  Start
+		 * over with a fresh connection; the rest of what was in
+		 * flight gets replayed on it.
+		 */
+		reset_svp_conn(sc, "server returned SVP_S_FATAL");
 		break;
 	case SVP_S_NOTFOUND:
-		/* This should be nominally silent. */
-		warn("Request not found...");
-		break;
-	case SVP_S_BADL3TYPE:
-		err(-18, "We apparently send a bad L3 type: not IPv4 or IPv6.");
-		break;
-	case SVP_S_BADBULK:
-		err(-17, "WTF are we doing with BADBULK?");
+		breaker_note(true);
+		/*
+		 * This should be nominally silent.  Remember it for a little
+		 * while so repeat solicits don't come back to us, and forget
+		 * any (stale) positive answer we had.
+		 */
+		insert_negative(&svpt->svpt_key, 0);
+		if (svpt->svpt_key.slk_af == AF_PACKET) {
+			remove_vl2_mapping(svpt->svpt_key.slk_vnetid,
+			    svpt->svpt_key.slk_addr);
+		} else {
+			remove_vl3_mapping(svpt->svpt_key.slk_vnetid,
+			    svpt->svpt_key.slk_addr);
+		}
 		break;
 	case SVP_S_OK:
+		breaker_note(true);
 		return (true);
 	default:
-		err(-20, "Invalid status value given: 0x%x\n",
-		    ntohl(wire_status));
+		/*
+		 * SVP_S_BADL3TYPE (we only send IPv4 or IPv6), SVP_S_BADBULK
+		 * (not an answer to a lookup), or something new.  Whatever the
+		 * server meant, there's no mapping in it; drop the answer and
+		 * let the kernel ask again.
+		 */
+		breaker_note(false);
+		txn_bad_status++;
+		warnx("SVP transaction 0x%x: unexpected status 0x%x, "
+		    "dropping", svpt->svpt_id, status);
+		break;
 	}
 	return (false);
 }
 
 /*
- * Extract ONE message from SVP
+ * SVP_R_SHOOTDOWN: another CN couldn't use the underlay mapping we gave it
+ * for this MAC, so ours is suspect too.  Forget it everywhere, and let
+ * the next packet look it up afresh.  Unsolicited, and there's no reply.
  */
-void
-handle_svp_inbound(int svp_fd)
+static void
+handle_shootdown(svp_req_t *svp_req)
 {
-	uint8_t buf[2048];
-	uint8_t *next = buf;
-	ssize_t recvlen = 0, payloadlen, chunk;
-	svp_remotereq_t *svprr = (svp_remotereq_t *)buf;
-	svp_req_t *svp_req = &svprr->svprr_head;
-	svp_transaction_t *svpt;
-
-	while (recvlen < sizeof (*svp_req)) {
-		chunk = recv(svp_fd, next, sizeof (*svp_req) - recvlen, 0);
-		if (chunk == -1)
-			errx(-13, "handle_svp_inbound: recv()");
+	svp_shootdown_t *svsd = (svp_shootdown_t *)(svp_req + 1);
+	fabric_link_t *vxlan;
+	uint32_t vnetid;
 
-		recvlen += chunk;
+	if (ntohl(svp_req->svp_size) < sizeof (*svsd)) {
+		warnx("handle_shootdown(): short shootdown (%u bytes)",
+		    ntohl(svp_req->svp_size));
+		return;
 	}
 
-	/* Will a compiler save an actual call? */
-	assert(svp_req->svp_ver == ntohs(SVP_CURRENT_VERSION));
-	payloadlen = ntohl(svp_req->svp_size);
-	if (payloadlen + sizeof (*svp_req) > sizeof (buf)) {
-		err(-1, "Protocol issue: payload len %lu is more than %lu",
-		    payloadlen + sizeof (*svp_req), sizeof (buf));
-	}
-	next += sizeof (*svp_req);
+	shootdowns++;
+	vnetid = ntohl(svsd->svsd_vnetid);
+	remove_vl2_mapping(vnetid, svsd->svsd_mac);
+	vxlan = vnet_to_link(vnetid);
+	if (vxlan != NULL)
+		shootdown_neighbors += shootdown_vl2(vxlan, svsd->svsd_mac);
+}
 
-	while (payloadlen > 0) {
-		chunk = recv(svp_fd, next, payloadlen, 0);
-		if (chunk == -1)
-			errx(-13, "handle_svp_inbound: recv()");
+/*
+ * Process one complete, CRC-checked frame.  svp_conn.c's reader hands it
+ * to us in place in the connection's receive buffer; payload follows the
+ * header, and svp_size is still in network order.
+ */
+void
+handle_svp_frame(svp_conn_t *sc, svp_req_t *svp_req)
+{
+	svp_remotereq_t *svprr = (svp_remotereq_t *)svp_req;
+	size_t payloadlen = ntohl(svp_req->svp_size);
+	svp_transaction_t *svpt;
+	fabric_link_t *link;
+	uint32_t i;
+	bool unchanged = false;
 
-		payloadlen -= chunk;
+	/* Bulk dumps and logs track their own; shootdowns are unsolicited. */
+	switch (ntohs(svp_req->svp_op)) {
+	case SVP_R_BULK_ACK:
+		handle_bulk_ack(sc, svp_req);
+		return;
+	case SVP_R_LOG_ACK:
+	case SVP_R_LOG_RM_ACK:
+		handle_log_ack(sc, svp_req);
+		return;
+	case SVP_R_SHOOTDOWN:
+		handle_shootdown(svp_req);
+		return;
 	}
 
 	svpt = find_transaction(svp_req->svp_id);
 	if (svpt == NULL) {
-		warn("handle_svp_inbound(): Can't find transaction 0x%u\n",
+		if (was_hedged(svp_req->svp_id)) {
+			hedge_losers++;
+			return;
+		}
+		warnx("handle_svp_frame(): Can't find transaction 0x%x",
 		    svp_req->svp_id);
 		return;
 	}
+	/* Only a first try's (or hedge's) answer is an unambiguous sample. */
+	if (svpt->svpt_hedge_conn == sc) {
+		hedge_wins++;
+		note_svp_rtt(sc, now_us() - svpt->svpt_hedge_sent_us);
+	} else if (svpt->svpt_conn == sc && svpt->svpt_tries == 1) {
+		note_svp_rtt(sc, now_us() - svpt->svpt_sent_us);
+	}
 
 	/* Exploit REC/ACK adjacency for fun & profit... */
-	if (ntohs(svp_req->svp_op) - 1 != ntohs(svpt->svpt_rr.svprr_op)) {
-		warn("handle_svp_inbound(): req(0x%x)/ack(0x%x) mismatch",
-		    ntohs(svpt->svpt_rr.svprr_op), ntohs(svp_req->svp_op));
+	if (ntohs(svp_req->svp_op) - 1 != svpt->svpt_op) {
+		warnx("handle_svp_frame(): req(0x%x)/ack(0x%x) mismatch",
+		    svpt->svpt_op, ntohs(svp_req->svp_op));
+		release_transaction(svpt);
 		return;
 	}
+	set_link_origin(svpt->svpt_id);
 	switch (ntohs(svp_req->svp_op)) {
 	case SVP_R_VL2_ACK:
-		if (status_check(svprr->svprr_l2a_status)) {
-			/*
-			 * Only the vxlan device should ask for VL2-type
-			 * requests.
-			 */
-			assert(svpt->svpt_link->fl_vxlan == NULL);
-			set_overlay_mac(svpt->svpt_rr.svprr_l2r_mac,
-			    svprr->svprr_l2a_ip, svpt->svpt_link->fl_name, 0);
+		if (payloadlen < sizeof (svp_vl2_ack_t)) {
+			warnx("handle_svp_frame(): short VL2 ack (%lu bytes)",
+			    payloadlen);
+			break;
+		}
+		if (status_check(ntohs(svprr->svprr_l2a_status), svpt, sc)) {
+			insert_vl2_mapping(svpt->svpt_key.slk_vnetid,
+			    svpt->svpt_key.slk_addr, svprr->svprr_l2a_ip,
+			    svprr->svprr_l2a_port);
+			for (i = 0; i < svpt->svpt_nwaiters; i++) {
+				link = index_to_link(svpt->svpt_waiters[i]);
+				if (link == NULL)
+					continue;	/* Went away. */
+				/*
+				 * Only the vxlan device should ask for
+				 * VL2-type requests.
+				 */
+				assert(link->fl_vxlan == NULL);
+				program_vl2(link, svpt->svpt_key.slk_addr,
+				    svprr->svprr_l2a_ip, svprr->svprr_l2a_port);
+			}
 		}
 		break;
 	case SVP_R_VL3_ACK:
@@ -391,45 +1009,147 @@ handle_svp_inbound(int svp_fd)
 		 *
 		 * Set the Overlay MAC first, however.
 		 */
-		if (!status_check(svprr->svprr_l3a_status))
+		if (payloadlen < sizeof (svp_vl3_ack_t)) {
+			warnx("handle_svp_frame(): short VL3 ack (%lu bytes)",
+			    payloadlen);
+			break;
+		}
+		if (!status_check(ntohl(svprr->svprr_l3a_status), svpt, sc))
 			break;
 
-		/*
-		 * Only the vlan-over-vxlan device should ask for VL3-type
-		 * requests.
-		 */
-		assert(svpt->svpt_link->fl_vxlan != NULL);
-
-		set_overlay_mac(svprr->svprr_l3a_mac, svprr->svprr_l3a_ip,
-		    svpt->svpt_link->fl_vxlan->fl_name, svpt->svpt_link->fl_id);
-		if (svpt->svpt_rr.svprr_l3r_type == ntohl(SVP_VL3_IP)) {
-			assert(
-			    IN6_IS_ADDR_V4MAPPED(svpt->svpt_rr.svprr_l3r_ip));
+		if (svpt->svpt_key.slk_af == AF_INET) {
+			assert(IN6_IS_ADDR_V4MAPPED(
+			    (struct in6_addr *)svpt->svpt_key.slk_addr));
 		} else {
-			assert(svpt->svpt_rr.svprr_l3r_type ==
-			    ntohl(SVP_VL3_IPV6) &&
-			    !IN6_IS_ADDR_V4MAPPED(svpt->svpt_rr.svprr_l3r_ip));
+			assert(svpt->svpt_key.slk_af == AF_INET6 &&
+			    !IN6_IS_ADDR_V4MAPPED(
+			    (struct in6_addr *)svpt->svpt_key.slk_addr));
+		}
+
+		insert_vl3_mapping(svpt->svpt_key.slk_vnetid,
+		    svpt->svpt_key.slk_addr, svprr->svprr_l3a_mac);
+		insert_vl2_mapping(svpt->svpt_key.slk_vnetid,
+		    svprr->svprr_l3a_mac, svprr->svprr_l3a_ip,
+		    svprr->svprr_l3a_port);
+
+		if (svpt->svpt_known) {
+			unchanged = memcmp(svpt->svpt_known_mac,
+			    svprr->svprr_l3a_mac, ETHERADDRL) == 0 &&
+			    memcmp(svpt->svpt_known_uip, svprr->svprr_l3a_ip,
+			    sizeof (svpt->svpt_known_uip)) == 0 &&
+			    svpt->svpt_known_uport == svprr->svprr_l3a_port;
+			if (unchanged)
+				reval_unchanged++;
+			else
+				reval_changed++;
+		}
+
+		/* One answer, program every link that was waiting on it. */
+		for (i = 0; i < svpt->svpt_nwaiters; i++) {
+			/* Skip those already holding this very answer. */
+			if (unchanged && (svpt->svpt_known_mask & (1U << i)))
+				continue;
+			link = index_to_link(svpt->svpt_waiters[i]);
+			if (link == NULL)
+				continue;	/* Went away. */
+			/*
+			 * Only the vlan-over-vxlan device should ask for
+			 * VL3-type requests.
+			 */
+			assert(link->fl_vxlan != NULL);
+
+			program_vl3(link, svpt->svpt_key.slk_addr,
+			    svprr->svprr_l3a_mac, svprr->svprr_l3a_ip,
+			    svprr->svprr_l3a_port);
 		}
-		set_overlay_ip(svpt->svpt_rr.svprr_l3r_ip,
-		    svprr->svprr_l3a_mac, svpt->svpt_link->fl_name);
 		break;
 	default:
-		errx(-15, "handle_svp_inbound(): Should never reach, ack 0x%x "
+		errx(-15, "handle_svp_frame(): Should never reach, ack 0x%x "
 		    "unimplmented\n", ntohs(svp_req->svp_op));
 		break;
 	}
+	set_link_origin(0);
 
-	free(svpt);	/* We're done with the outstanding transaction. */
+	/* We're done with the outstanding transaction. */
+	release_transaction(svpt);
 }
 
 /*
- * Send an SVP_R_VL3_REQ
+ * Ask Portolan about "key" (op is SVP_R_VL2_REQ or SVP_R_VL3_REQ) for link
+ * "index", or if the same lookup is already in flight, just wait on its
+ * answer.  If "known_mac" is set, this is a VL3 revalidation and "index"
+ * already has that mapping programmed.
  */
-void
-send_l3_req(int32_t index, uint8_t af, uint8_t *addr)
+static void
+start_lookup(int32_t index, uint16_t op, const svp_lookup_key_t *key,
+    const uint8_t *known_mac, const uint8_t *known_uip, uint16_t known_uport)
 {
 	svp_transaction_t *svpt;
-	svp_remotereq_t *svprr;
+
+	/* Portolan recently told us this doesn't exist. */
+	if (find_negative(key))
+		return;
+
+	svpt = find_inflight(key);
+	if (svpt != NULL) {
+		txn_coalesced++;
+		(void) add_waiter(svpt, index);
+		return;
+	}
+
+	/* Portolan's in trouble; don't pile on. */
+	if (!breaker_admit()) {
+		brk_rejected++;
+		if (known_mac == NULL)
+			insert_negative(key, SVP_BRK_NEG_TTL);
+		return;
+	}
+
+	/* Bound what we'll sit on while there's nowhere to send it. */
+	if (txn_parked >= txn_park_max && pick_svp_conn(NULL) == NULL) {
+		txn_park_drops++;
+		return;
+	}
+
+	svpt = pool_alloc(&txn_pool);
+	svpt->svpt_key = *key;
+	(void) add_waiter(svpt, index);
+	if (known_mac != NULL) {
+		svpt->svpt_known = true;
+		svpt->svpt_known_mask = 1;	/* Waiter 0 is us. */
+		memcpy(svpt->svpt_known_mac, known_mac, ETHERADDRL);
+		memcpy(svpt->svpt_known_uip, known_uip,
+		    sizeof (svpt->svpt_known_uip));
+		svpt->svpt_known_uport = known_uport;
+		reval_sent++;
+	}
+	svpt->svpt_op = op;
+	svpt->svpt_id = new_svp_id();
+
+	if (!insert_transaction(svpt)) {
+		warnx("start_lookup: %u transactions outstanding, dropping",
+		    txn_count);
+		pool_free(&txn_pool, svpt);
+		return;
+	}
+	if (op == SVP_R_VL2_REQ)
+		txn_vl2_inserts++;
+
+	svpt->svpt_timer.vt_func = expire_transaction;
+	svpt->svpt_timer.vt_arg = svpt;
+	svpt->svpt_hedge_timer.vt_func = hedge_transaction;
+	svpt->svpt_hedge_timer.vt_arg = svpt;
+	(void) transmit_transaction(svpt);
+}
+
+/*
+ * Send an SVP_R_VL3_REQ for a neighbor miss on fabric link "index".
+ */
+static void
+start_l3_req(int32_t index, uint8_t af, const uint8_t *addr,
+    const uint8_t *known_mac, const uint8_t *known_uip, uint16_t known_uport)
+{
+	svp_lookup_key_t key;
 	fabric_link_t *link = index_to_link(index);
 
 	if (link == NULL) {
@@ -446,42 +1166,58 @@ send_l3_req(int32_t index, uint8_t af, uint8_t *addr)
 	}
 
 	assert(link->fl_vxlan != NULL);	/* MUST be a vlan-over-vxlan */
-	svpt = calloc(1, sizeof (*svpt));
-	if (svpt == NULL)
-		errx(-10, "send_l3_req() - allocation failed\n");
 
-	svpt->svpt_link = link;
-	svprr = &svpt->svpt_rr;
+	memset(&key, 0, sizeof (key));
+	key.slk_vnetid = link->fl_vxlan->fl_id;
+	key.slk_af = af;
+	memcpy(key.slk_addr, addr, sizeof (struct in6_addr));
 
-	svprr->svprr_ver = htons(SVP_CURRENT_VERSION);
-	svprr->svprr_op = htons(SVP_R_VL3_REQ);
-	svprr->svprr_size = htonl(sizeof (svp_vl3_req_t));
-	if (our_svp_id == 0)
-		our_svp_id = 1;
-	svprr->svprr_id = our_svp_id++;
+	start_lookup(index, SVP_R_VL3_REQ, &key, known_mac, known_uip,
+	    known_uport);
+}
 
-	memcpy(svprr->svprr_l3r_ip, addr, sizeof (struct in6_addr));
-	svprr->svprr_l3r_vnetid = htonl(link->fl_vxlan->fl_id);
-	svprr->svprr_l3r_type = (af == AF_INET6) ?
-	    htons(SVP_VL3_IPV6) : htonl(SVP_VL3_IP);
-	svprr->svprr_crc32 = 0;
-	svprr->svprr_crc32 =
-	    htonl(svp_crc(svprr, sizeof (svp_req_t) + sizeof (svp_vl3_req_t)));
+void
+send_l3_req(int32_t index, uint8_t af, uint8_t *addr)
+{
+	start_l3_req(index, af, addr, NULL, NULL, 0);
+}
 
-	if (send(svp_fd, svprr, sizeof (svp_req_t) + sizeof (svp_vl3_req_t), 0)
-	    == -1) {
-		warnx("send_l3_req: send()");
-		free(svpt);
-		return;
-	}
-	insert_transaction(svpt);
+/*
+ * "index" was just (re-)programmed from a possibly-stale cached mapping;
+ * check it against Portolan in the background.
+ */
+void
+revalidate_l3_req(int32_t index, uint8_t af, const uint8_t *addr,
+    const uint8_t *mac, const uint8_t *uip, uint16_t uport)
+{
+	start_l3_req(index, af, addr, mac, uip, uport);
 }
 
 /*
- * Send an SVP_R_VL2_REQ
+ * Send an SVP_R_VL2_REQ for an l2miss on vxlan link "index".  The MAC is
+ * in the first ETHERADDRL bytes of "mac_and_pad", as in svp_vl2_req64_t.
  */
 void
 send_l2_req(int32_t index, uint64_t mac_and_pad)
 {
-	err(2, "send_l2_req() not yet built"); /* XXX KEBE SAYS FILL ME IN! */
+	svp_lookup_key_t key;
+	fabric_link_t *link = index_to_link(index);
+
+	if (link == NULL) {
+		/* See start_l3_req(). */
+		warnx("index %d had no internal link state.", index);
+		return;
+	}
+	if (link->fl_vxlan != NULL) {
+		/* Only the vxlan device itself reports l2miss. */
+		warnx("VL2 miss on non-vxlan link %s, ignoring", link->fl_name);
+		return;
+	}
+
+	memset(&key, 0, sizeof (key));
+	key.slk_vnetid = link->fl_id;
+	key.slk_af = AF_PACKET;
+	memcpy(key.slk_addr, &mac_and_pad, ETHERADDRL);
+
+	start_lookup(index, SVP_R_VL2_REQ, &key, NULL, NULL, 0);
 }
@@ -12,15 +12,154 @@
 #define	_SVP_H
 
 #include "svp_prot.h"	/* Happily includes a bunch of things we need. */
+#include "timer.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-extern int new_svp(struct sockaddr_in *);
-extern void handle_svp_inbound(int);
+/*
+ * The identity of a lookup, independent of which link asked for it.  Used
+ * to coalesce in-flight requests.  slk_af is AF_INET or AF_INET6 for VL3
+ * lookups (IPv4 stored v4-mapped, as on the wire), or AF_PACKET for VL2
+ * lookups, with the MAC in the first ETHERADDRL bytes of slk_addr.  Unused
+ * bytes MUST be zero, keys are compared with memcmp().
+ */
+typedef struct svp_lookup_key {
+	uint32_t slk_vnetid;		/* Host order */
+	uint8_t slk_af;
+	uint8_t slk_pad[3];
+	uint8_t slk_addr[16];
+} svp_lookup_key_t;
+
+/*
+ * A receive or send buffer.  Bytes [sb_head, sb_tail) are unconsumed (not
+ * yet parsed, or not yet written to the socket); they get slid back to the
+ * start, or the buffer grown, when more room is needed.
+ */
+typedef struct svp_buf {
+	uint8_t *sb_buf;
+	size_t sb_size;
+	size_t sb_head;
+	size_t sb_tail;
+} svp_buf_t;
+
+/*
+ * A log-linear histogram of RTTs in microseconds: 2^SVP_HIST_SUB buckets
+ * per power of two, so percentiles are good to within ~25%.
+ */
+#define	SVP_HIST_SUB		2
+#define	SVP_HIST_BUCKETS	(32 << SVP_HIST_SUB)
+
+typedef struct svp_hist {
+	uint32_t sh_counts[SVP_HIST_BUCKETS];
+	uint32_t sh_total;
+} svp_hist_t;
+
+/*
+ * svp_ids from SVP_ID_RESERVED up are never handed out by new_svp_id();
+ * svp_conn.c uses them for PINGs, SVP_KA_SLOTS of them for keepalives.
+ */
+#define	SVP_ID_RESERVED		0xffffff00U
+#define	SVP_KA_SLOTS		4
+
+/*
+ * Connection states.  Anything that goes wrong, from any state, closes the
+ * socket and drops back to SVP_CS_DOWN to wait out a backoff before the
+ * next connect().  Only SVP_CS_UP carries transactions.
+ */
+typedef enum svp_conn_state {
+	SVP_CS_DOWN = 0,	/* No socket, reconnect timer armed */
+	SVP_CS_CONNECTING,	/* Non-blocking connect() in progress */
+	SVP_CS_HANDSHAKE,	/* PING sent, waiting for the PONG */
+	SVP_CS_UP
+} svp_conn_state_t;
+
+/* A connection to a Portolan server. */
+typedef struct svp_conn {
+	int sc_fd;			/* -1 if SVP_CS_DOWN */
+	svp_conn_state_t sc_state;
+	struct sockaddr_in sc_addr;
+	varpd_timer_t sc_timer;		/* Backoff, connect/PONG timeout */
+	uint64_t sc_backoff_ms;		/* Next reconnect delay */
+	svp_buf_t sc_in;
+	svp_buf_t sc_out;
+	/* Load balancing and health, see pick_svp_conn(). */
+	uint32_t sc_outstanding;	/* Transactions last sent here */
+	uint64_t sc_srtt_us;		/* Smoothed RTT, 0 if no sample yet */
+	uint32_t sc_fails;		/* Consecutive unanswered tries */
+	uint64_t sc_eject_until;	/* now_ms() when it's eligible again */
+	uint64_t sc_eject_ms;		/* Length of the next ejection */
+	uint64_t sc_ejections;
+	uint32_t sc_limit;		/* Adaptive cap on sc_outstanding */
+	uint32_t sc_limit_acc;		/* Answers towards the next +1 */
+	uint64_t sc_min_rtt_us;		/* Uncongested RTT baseline */
+	uint32_t sc_min_rtt_age;	/* Samples since it was set */
+	uint64_t sc_last_cut_us;	/* now_us() of the last decrease */
+	uint64_t sc_limit_cuts;
+	/* Keepalives, see conn_keepalive(). */
+	varpd_timer_t sc_ka_timer;
+	uint32_t sc_ka_next;		/* Slot to try first for the next */
+	uint64_t sc_ka_sent_us[SVP_KA_SLOTS];	/* When sent, 0 if not out */
+	uint64_t sc_ka_sent;
+	uint64_t sc_ka_answered;
+	uint64_t sc_ka_stray;		/* PONGs matching nothing we sent */
+	uint64_t sc_ka_deaths;		/* Resets for unanswered keepalives */
+	svp_hist_t sc_rtt_hist;		/* Lookup and keepalive RTTs */
+	uint64_t sc_connects;		/* connect() attempts */
+	uint64_t sc_resets;		/* Times we've lost it */
+	uint64_t sc_frames_in;
+	uint64_t sc_bytes_in;
+	uint64_t sc_crc_errors;
+	uint64_t sc_frames_out;
+	uint64_t sc_bytes_out;
+	uint64_t sc_sends;		/* send() calls that moved bytes */
+	uint64_t sc_short_sends;	/* ...of which were partial/EAGAIN */
+	uint64_t sc_out_full;		/* append_svp_frame() refusals */
+} svp_conn_t;
+
+/* True if there's queued output, i.e. poll() should ask for POLLOUT. */
+#define	SVP_CONN_PENDING(sc)	((sc)->sc_out.sb_tail != (sc)->sc_out.sb_head)
+
+extern void init_transactions(uint32_t, uint32_t);
+extern void init_hedging(uint32_t, uint32_t);
+extern uint32_t svp_crc(void *, size_t);
+extern uint32_t new_svp_id(void);
+/* The pool of Portolan servers, see svp_conn.c. */
+#define	SVP_MAX_SERVERS	8
+extern svp_conn_t *svp_pool[SVP_MAX_SERVERS];
+extern uint32_t svp_npool;
+
+extern void add_svp_server(struct sockaddr_in *);
+extern svp_conn_t *pick_svp_conn(const svp_conn_t *);
+extern void note_svp_rtt(svp_conn_t *, uint64_t);
+extern uint64_t svp_rtt_percentile(uint32_t);
+extern void note_svp_timeout(svp_conn_t *);
+extern void dump_svp_pool_stats(void);
+extern short svp_conn_events(svp_conn_t *);
+extern void handle_svp_events(svp_conn_t *, short);
+extern void reset_svp_conn(svp_conn_t *, const char *);
+extern void *append_svp_frame(svp_conn_t *, size_t);
+extern void flush_svp_conn(svp_conn_t *);
+extern void handle_svp_frame(svp_conn_t *, svp_req_t *);
+extern void reroute_transactions(svp_conn_t *);
+extern void replay_transactions(void);
 extern void send_l3_req(int32_t, uint8_t, uint8_t *);
+extern void revalidate_l3_req(int32_t, uint8_t, const uint8_t *,
+    const uint8_t *, const uint8_t *, uint16_t);
 extern void send_l2_req(int32_t, uint64_t);
+extern void dump_svp_stats(void);
+/* Bulk preload, see svp_bulk.c. */
+extern void init_svp_bulk(void);
+extern void request_svp_bulk(void);
+extern void resume_svp_bulk(void);
+extern void handle_bulk_ack(svp_conn_t *, svp_req_t *);
+extern void dump_svp_bulk_stats(void);
+/* Change-log sync, see svp_log.c. */
+extern void init_log_sync(const struct in_addr *);
+extern void resume_svp_log(void);
+extern void handle_log_ack(svp_conn_t *, svp_req_t *);
+extern void dump_svp_log_stats(void);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,431 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2023 MNX Cloud, Inc.
+ */
+
+/*
+ * Bulk preload (-b).  After a CN reboot every guest comes up at once and ARPs
+ * for its peers one at a time; rather than take those misses, we ask
+ * Portolan for its whole VL2 table, then its whole VL3 table
+ * (SVP_R_BULK_REQ), load them into the cache, and program every VL3
+ * mapping for a vnet/VLAN we have a fabric link on.  VL2 goes first so
+ * each VL3 record finds its MAC's underlay address already cached.
+ *
+ * A preload runs at startup and whenever a new vnet shows up (see
+ * chase_down()), after a short holdoff so a burst of new links costs one
+ * run.  Asking while one is running queues exactly one more.  Only one
+ * BULK_REQ is ever outstanding; its ack is matched on bk_id, not through
+ * svp.c's transaction table, since it doesn't time out, retry, or count
+ * against the pool the way lookups do.
+ *
+ * Acks are decoded record-at-a-time straight out of the connection's
+ * receive buffer (the frame has to be complete to check its CRC anyway),
+ * and kernel updates go out through one begin_link_batch() per ack rather
+ * than one shell-out per mapping.
+ *
+ * The protocol doesn't define a BULK_ACK payload (see svp_prot.h), so the
+ * record layout below is our own guess at one, and is why the preload is
+ * off unless asked for.  A server sending anything else would have us
+ * program garbage, so an ack is checked in full before any of it is used,
+ * and one bad record throws out the whole ack.
+ */
+
+#include <err.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <netinet/in.h>
+
+#include "link.h"
+#include "svp.h"
+#include "timer.h"
+#include "cache.h"
+
+#define	SVP_BULK_HOLDOFF_MS	1000
+#define	SVP_BULK_TIMEOUT_MS	(30 * 1000)	/* Dumps can be big. */
+#define	SVP_BULK_MAX_TRIES	3
+#define	SVP_BULK_MAX_LINKS	16	/* Fabric links per vnet/VLAN */
+#define	SVP_BULK_MAX_VLAN	4094
+
+/*
+ * svba_data is a packed array of fixed-size records, all of the svba_type
+ * kind.  Ports and vnetids are in network order, as in the VL2/VL3 acks.
+ * IPv4 addresses are IPv4-mapped IPv6.
+ */
+typedef struct svp_bulk_vl2 {
+	uint8_t		sbv2_mac[ETHERADDRL];
+	uint16_t	sbv2_port;
+	uint32_t	sbv2_vnetid;
+	uint8_t		sbv2_addr[16];
+} svp_bulk_vl2_t;
+
+typedef struct svp_bulk_vl3 {
+	uint8_t		sbv3_ip[16];
+	uint32_t	sbv3_vnetid;
+	uint16_t	sbv3_vlan;
+	uint8_t		sbv3_mac[ETHERADDRL];
+} svp_bulk_vl3_t;
+
+typedef enum svp_bulk_state {
+	SVP_BK_IDLE = 0,
+	SVP_BK_WAITING,		/* Holding off, or no server to ask */
+	SVP_BK_VL2,		/* VL2 dump outstanding */
+	SVP_BK_VL3		/* VL3 dump outstanding */
+} svp_bulk_state_t;
+
+static void bulk_timer(void *);
+
+static bool bk_enabled;		/* -b */
+static svp_bulk_state_t bk_state;
+static bool bk_again;		/* Asked for again while running */
+static bool bk_unsupported;	/* Portolan said SVP_S_BADBULK */
+static uint32_t bk_id;		/* Of the outstanding BULK_REQ */
+static svp_conn_t *bk_conn;	/* ...where it went */
+static uint64_t bk_conn_gen;	/* ...and that conn's sc_connects then */
+static uint32_t bk_tries;
+static uint64_t bk_start_ms;
+static varpd_timer_t bk_timer = { .vt_func = bulk_timer };
+
+static uint64_t bk_runs, bk_failures, bk_malformed;
+static uint64_t bk_vl2_records, bk_vl3_records;
+static uint64_t bk_foreign, bk_programmed, bk_kernel_updates;
+
+/* Turn preloading on; main() calls this before the first link scan. */
+void
+init_svp_bulk(void)
+{
+	bk_enabled = true;
+}
+
+/* Queue a preload; see above. */
+void
+request_svp_bulk(void)
+{
+	if (!bk_enabled || bk_unsupported)
+		return;
+	if (bk_state != SVP_BK_IDLE) {
+		if (bk_state != SVP_BK_WAITING)
+			bk_again = true;
+		return;
+	}
+	bk_state = SVP_BK_WAITING;
+	arm_timer(&bk_timer, SVP_BULK_HOLDOFF_MS);
+}
+
+/*
+ * (Re)send the BULK_REQ for the current phase, or if there's nowhere to
+ * send it, try again after a holdoff.
+ */
+static void
+send_bulk(void)
+{
+	svp_conn_t *sc = pick_svp_conn(NULL);
+	svp_req_t *svp;
+	svp_bulk_req_t *svbr;
+
+	if (bk_state == SVP_BK_WAITING) {
+		bk_state = SVP_BK_VL2;
+		bk_tries = 0;
+		bk_start_ms = now_ms();
+	}
+
+	svp = (sc == NULL) ? NULL :
+	    append_svp_frame(sc, sizeof (*svp) + sizeof (*svbr));
+	if (svp == NULL) {
+		bk_conn = NULL;
+		arm_timer(&bk_timer, SVP_BULK_HOLDOFF_MS);
+		return;
+	}
+	svbr = (svp_bulk_req_t *)(svp + 1);
+
+	bk_id = new_svp_id();
+	bk_conn = sc;
+	bk_conn_gen = sc->sc_connects;
+	bk_tries++;
+
+	svp->svp_ver = htons(SVP_CURRENT_VERSION);
+	svp->svp_op = htons(SVP_R_BULK_REQ);
+	svp->svp_size = htonl(sizeof (*svbr));
+	svp->svp_id = bk_id;
+	svp->svp_crc32 = 0;
+	svbr->svbr_type = htonl(bk_state == SVP_BK_VL2 ?
+	    SVP_BULK_VL2 : SVP_BULK_VL3);
+	svp->svp_crc32 = htonl(svp_crc(svp, sizeof (*svp) + sizeof (*svbr)));
+
+	arm_timer(&bk_timer, SVP_BULK_TIMEOUT_MS);
+}
+
+/* Done, one way or another; start the queued run, if any. */
+static void
+finish_bulk(bool ok)
+{
+	cancel_timer(&bk_timer);
+	bk_state = SVP_BK_IDLE;
+	bk_conn = NULL;
+	if (ok)
+		bk_runs++;
+	else
+		bk_failures++;
+
+	if (bk_again) {
+		bk_again = false;
+		request_svp_bulk();
+	}
+}
+
+static void
+bulk_timer(void *arg)
+{
+	if (bk_state == SVP_BK_WAITING || bk_conn == NULL) {
+		send_bulk();
+		return;
+	}
+
+	if (bk_tries < SVP_BULK_MAX_TRIES) {
+		send_bulk();
+		return;
+	}
+
+	warnx("SVP bulk %s dump timed out after %u tries, giving up",
+	    bk_state == SVP_BK_VL2 ? "VL2" : "VL3", bk_tries);
+	finish_bulk(false);
+}
+
+/*
+ * A connection came up.  If the outstanding BULK_REQ went down with an
+ * earlier one, don't wait for the timeout to resend it.
+ */
+void
+resume_svp_bulk(void)
+{
+	if (bk_state != SVP_BK_VL2 && bk_state != SVP_BK_VL3)
+		return;
+	if (bk_conn == NULL || bk_conn->sc_state != SVP_CS_UP ||
+	    bk_conn->sc_connects != bk_conn_gen)
+		send_bulk();
+}
+
+static bool
+bulk_mac_ok(const uint8_t *mac)
+{
+	static const uint8_t zero[ETHERADDRL];
+
+	return ((mac[0] & 1) == 0 && memcmp(mac, zero, ETHERADDRL) != 0);
+}
+
+static bool
+bulk_ip_ok(const uint8_t *ip)
+{
+	const struct in6_addr *in6 = (const struct in6_addr *)ip;
+
+	return (!IN6_IS_ADDR_UNSPECIFIED(in6) &&
+	    !IN6_IS_ADDR_MULTICAST(in6) && !(IN6_IS_ADDR_V4MAPPED(in6) &&
+	    (in6->s6_addr32[3] == INADDR_ANY ||
+	    IN_MULTICAST(ntohl(in6->s6_addr32[3])))));
+}
+
+/*
+ * Before using any of an ack, check that every record in it could be a
+ * real mapping.  Returns the index of the first that couldn't, or "nrecs".
+ */
+static size_t
+check_bulk_records(const uint8_t *data, size_t nrecs)
+{
+	const svp_bulk_vl2_t *vl2 = (const svp_bulk_vl2_t *)data;
+	const svp_bulk_vl3_t *vl3 = (const svp_bulk_vl3_t *)data;
+	size_t i;
+
+	for (i = 0; i < nrecs; i++) {
+		if (bk_state == SVP_BK_VL2) {
+			if (!bulk_mac_ok(vl2[i].sbv2_mac) ||
+			    !bulk_ip_ok(vl2[i].sbv2_addr))
+				break;
+		} else {
+			if (!bulk_mac_ok(vl3[i].sbv3_mac) ||
+			    !bulk_ip_ok(vl3[i].sbv3_ip) ||
+			    ntohs(vl3[i].sbv3_vlan) > SVP_BULK_MAX_VLAN)
+				break;
+		}
+	}
+	return (i);
+}
+
+/*
+ * Cache VL2 (MAC -> underlay) records for vnets we have, so the VL3 pass
+ * can program both halves.
+ */
+static void
+load_bulk_vl2(const svp_bulk_vl2_t *rec, size_t nrecs)
+{
+	uint32_t vnetid, last_vnetid = 0;
+	bool have = false;
+	size_t i;
+
+	for (i = 0; i < nrecs; i++, rec++) {
+		vnetid = ntohl(rec->sbv2_vnetid);
+		if (i == 0 || vnetid != last_vnetid) {
+			have = (vnet_to_link(vnetid) != NULL);
+			last_vnetid = vnetid;
+		}
+		if (!have) {
+			bk_foreign++;
+			continue;
+		}
+		insert_vl2_mapping(vnetid, rec->sbv2_mac, rec->sbv2_addr,
+		    rec->sbv2_port);
+		bk_vl2_records++;
+	}
+}
+
+/*
+ * Cache VL3 (IP -> MAC) records for vnets we have, and program each on
+ * every fabric link on its VLAN.  Records are expected to come grouped by
+ * vnet and VLAN, so the link lookups are remembered from one to the next.
+ */
+static void
+load_bulk_vl3(const svp_bulk_vl3_t *rec, size_t nrecs)
+{
+	fabric_link_t *links[SVP_BULK_MAX_LINKS];
+	uint32_t vnetid, last_vnetid = 0, nlinks = 0, j;
+	uint16_t vlan, last_vlan = 0, uport;
+	uint8_t uip[16];
+	bool have = false;
+	size_t i;
+
+	begin_link_batch();
+	set_link_origin(bk_id);
+	for (i = 0; i < nrecs; i++, rec++) {
+		vnetid = ntohl(rec->sbv3_vnetid);
+		vlan = ntohs(rec->sbv3_vlan);
+		if (i == 0 || vnetid != last_vnetid || vlan != last_vlan) {
+			if (i == 0 || vnetid != last_vnetid)
+				have = (vnet_to_link(vnetid) != NULL);
+			nlinks = have ? find_fabric_links(vnetid, vlan, links,
+			    SVP_BULK_MAX_LINKS) : 0;
+			last_vnetid = vnetid;
+			last_vlan = vlan;
+		}
+		if (!have) {
+			bk_foreign++;
+			continue;
+		}
+		insert_vl3_mapping(vnetid, rec->sbv3_ip, rec->sbv3_mac);
+		bk_vl3_records++;
+
+		if (nlinks == 0 || !find_vl2_mapping(vnetid, rec->sbv3_mac,
+		    uip, &uport, false))
+			continue;
+		for (j = 0; j < nlinks; j++)
+			program_vl3(links[j], rec->sbv3_ip, rec->sbv3_mac, uip,
+			    uport);
+		bk_programmed++;
+	}
+	set_link_origin(0);
+	bk_kernel_updates += end_link_batch();
+}
+
+/*
+ * An SVP_R_BULK_ACK arrived on "sc", complete and CRC-checked, in place
+ * in its receive buffer.
+ */
+void
+handle_bulk_ack(svp_conn_t *sc, svp_req_t *svp_req)
+{
+	size_t len = ntohl(svp_req->svp_size);
+	svp_bulk_ack_t *svba = (svp_bulk_ack_t *)(svp_req + 1);
+	uint32_t want = (bk_state == SVP_BK_VL2) ? SVP_BULK_VL2 : SVP_BULK_VL3;
+	size_t recsize = (want == SVP_BULK_VL2) ?
+	    sizeof (svp_bulk_vl2_t) : sizeof (svp_bulk_vl3_t);
+	size_t bad;
+
+	if ((bk_state != SVP_BK_VL2 && bk_state != SVP_BK_VL3) ||
+	    svp_req->svp_id != bk_id) {
+		warnx("Ignoring stale SVP bulk ack 0x%x", svp_req->svp_id);
+		return;
+	}
+	if (len < sizeof (*svba)) {
+		warnx("handle_bulk_ack(): short ack (%lu bytes)", len);
+		finish_bulk(false);
+		return;
+	}
+
+	switch (ntohl(svba->svba_status)) {
+	case SVP_S_OK:
+		break;
+	case SVP_S_NOTFOUND:
+		len = sizeof (*svba);	/* Nothing to load; not an error. */
+		break;
+	case SVP_S_BADBULK:
+		warnx("Portolan doesn't do bulk dumps, not asking again");
+		bk_unsupported = true;
+		finish_bulk(false);
+		return;
+	case SVP_S_FATAL:
+		/* resume_svp_bulk() resends once we've reconnected. */
+		reset_svp_conn(sc, "server returned SVP_S_FATAL");
+		return;
+	default:
+		warnx("handle_bulk_ack(): bad status 0x%x",
+		    ntohl(svba->svba_status));
+		finish_bulk(false);
+		return;
+	}
+	if (len > sizeof (*svba) && ntohl(svba->svba_type) != want) {
+		warnx("handle_bulk_ack(): asked for type %u, got %u", want,
+		    ntohl(svba->svba_type));
+		finish_bulk(false);
+		return;
+	}
+
+	len -= sizeof (*svba);
+	if (len % recsize != 0 ||
+	    (bad = check_bulk_records(svba->svba_data, len / recsize)) !=
+	    len / recsize) {
+		/* Not the format we expect; trust none of it. */
+		if (len % recsize != 0) {
+			warnx("handle_bulk_ack(): %lu bytes isn't a whole "
+			    "number of records", len);
+		} else {
+			warnx("handle_bulk_ack(): record %lu of %lu is "
+			    "malformed", bad, len / recsize);
+		}
+		bk_malformed++;
+		finish_bulk(false);
+		return;
+	}
+
+	if (bk_state == SVP_BK_VL2) {
+		load_bulk_vl2((svp_bulk_vl2_t *)svba->svba_data,
+		    len / recsize);
+		bk_state = SVP_BK_VL3;
+		bk_tries = 0;
+		send_bulk();
+		return;
+	}
+
+	load_bulk_vl3((svp_bulk_vl3_t *)svba->svba_data, len / recsize);
+	warnx("SVP bulk preload done in %lu ms", now_ms() - bk_start_ms);
+	finish_bulk(true);
+}
+
+void
+dump_svp_bulk_stats(void)
+{
+	static const char *states[] = { "idle", "waiting", "VL2", "VL3" };
+
+	if (!bk_enabled) {
+		warnx("SVP bulk: off");
+		return;
+	}
+	warnx("SVP bulk: %s, %lu runs, %lu failed (%lu malformed), %lu VL2 "
+	    "and %lu VL3 mappings loaded, %lu for other vnets",
+	    states[bk_state], bk_runs, bk_failures, bk_malformed,
+	    bk_vl2_records, bk_vl3_records, bk_foreign);
+	warnx("SVP bulk: %lu VL3 mappings programmed, %lu kernel updates",
+	    bk_programmed, bk_kernel_updates);
+}
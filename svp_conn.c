@@ -0,0 +1,884 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2023 MNX Cloud, Inc.
+ */
+
+/*
+ * SVP connection management: keeping TCP connections to a pool of
+ * Portolan servers up, choosing which one gets each request, pulling
+ * frames off of them, and batching frames onto them.  What the frames
+ * *mean* is svp.c's business.
+ *
+ * Outbound requests are encoded by svp.c directly into sc_out (see
+ * append_svp_frame()) and written out together by flush_svp_conn(), which
+ * main() calls once per trip around the event loop.  Because sc_out is a
+ * single compacting linear buffer, everything queued is always contiguous
+ * and one send() covers it all; no iovec is needed.
+ */
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+
+#include "svp.h"
+#include "link.h"
+
+/*
+ * Receive buffers start out big enough for a few hundred VL3 acks, and
+ * grow (up to SVP_MAX_FRAME) if a single frame, e.g. a BULK or LOG ack,
+ * won't fit.
+ */
+#define	SVP_INBUF_SIZE	(64 * 1024)
+#define	SVP_MAX_FRAME	(16 * 1024 * 1024)
+
+/*
+ * Send buffers likewise start at 64k, and may grow to 1M (~16k VL3
+ * requests) if Portolan stops draining the socket.  Past that, new frames
+ * are refused and the transaction retry timers sort it out.  Once
+ * SVP_FLUSH_BYTES are queued we don't wait for the end of the loop.
+ */
+#define	SVP_OUTBUF_SIZE	(64 * 1024)
+#define	SVP_OUTBUF_MAX	(1024 * 1024)
+#define	SVP_FLUSH_BYTES	(32 * 1024)
+
+/*
+ * Reconnects back off exponentially, with jitter, from 100ms to 30s, so a
+ * Portolan restart doesn't get every CN knocking at once.  A connect() or
+ * PING that takes longer than SVP_CONNECT_TIMEOUT_MS counts as a failure.
+ */
+#define	SVP_BACKOFF_MIN_MS	100
+#define	SVP_BACKOFF_MAX_MS	(30 * 1000)
+#define	SVP_CONNECT_TIMEOUT_MS	(5 * 1000)
+
+#define	SVP_PING_ID	0xffffffff	/* Handshake; see SVP_ID_RESERVED */
+
+/*
+ * Keepalives.  While a connection is up, a PING goes out on it every
+ * SVP_KA_INTERVAL_MS whether or not earlier ones are answered yet, so a
+ * slow server shows up as RTT rather than silence.  Each carries one of
+ * the SVP_KA_SLOTS reserved ids from SVP_ID_RESERVED up.  If SVP_KA_MISSES
+ * (less than SVP_KA_SLOTS) are still out when the next is due, the server
+ * is gone and the connection is reset.
+ */
+#define	SVP_KA_INTERVAL_MS	1000
+#define	SVP_KA_MISSES		3
+
+/*
+ * Pool health.  SVP_EJECT_FAILS consecutive unanswered requests eject a
+ * server for SVP_EJECT_MIN_MS, doubling up to SVP_EJECT_MAX_MS while it
+ * stays unresponsive.  Servers without an RTT sample yet are assumed to
+ * be at SVP_RTT_INITIAL_US.
+ */
+#define	SVP_EJECT_FAILS		3
+#define	SVP_EJECT_MIN_MS	1000
+#define	SVP_EJECT_MAX_MS	(60 * 1000)
+#define	SVP_RTT_INITIAL_US	1000
+
+/*
+ * Adaptive concurrency limit, per server, AIMD on RTT: each answer that
+ * isn't slow grows sc_limit by 1/sc_limit (so +1 per limit's worth of
+ * answers), and an answer slower than SVP_LIMIT_SLOW times the best RTT
+ * seen lately, or a timeout, cuts it by 10%, at most once per srtt.
+ * sc_min_rtt_us is re-learned every SVP_MINRTT_SAMPLES answers so it can
+ * follow a server that's got permanently slower (or a different one).
+ */
+#define	SVP_LIMIT_INITIAL	64
+#define	SVP_LIMIT_MIN		4
+#define	SVP_LIMIT_MAX		4096
+#define	SVP_LIMIT_SLOW		3
+#define	SVP_LIMIT_SLACK_US	1000	/* LAN RTTs are noisy at this scale */
+#define	SVP_MINRTT_SAMPLES	1000
+
+svp_conn_t *svp_pool[SVP_MAX_SERVERS];
+uint32_t svp_npool;
+
+/*
+ * RTT histograms (svp_hist_t) have their counts halved whenever the total
+ * reaches SVP_HIST_DECAY, so old behaviour fades; below SVP_HIST_MIN
+ * samples we don't claim to know anything.
+ *
+ * rtt_hist is first-try lookup RTTs across the whole pool, for hedging
+ * decisions.  Keepalives skip Portolan's backend, so they'd make lookups
+ * look faster than they are; they only go into each connection's own
+ * sc_rtt_hist and srtt.
+ */
+#define	SVP_HIST_DECAY		4096
+#define	SVP_HIST_MIN		100
+
+static svp_hist_t rtt_hist;
+
+static void
+init_buf(svp_buf_t *sb, size_t size)
+{
+	sb->sb_buf = malloc(size);
+	if (sb->sb_buf == NULL)
+		errx(-11, "init_buf(): can't allocate %lu bytes", size);
+	sb->sb_size = size;
+	sb->sb_head = sb->sb_tail = 0;
+}
+
+/*
+ * Make sure there's room for "need" contiguous bytes starting at sb_head,
+ * and at least some room past sb_tail.  Slides unconsumed bytes to the
+ * front first; only grows if that's not enough.
+ */
+static void
+make_room(svp_buf_t *sb, size_t need)
+{
+	size_t used = sb->sb_tail - sb->sb_head;
+	size_t newsize;
+	uint8_t *newbuf;
+
+	if (sb->sb_head != 0 && (sb->sb_tail == sb->sb_size ||
+	    sb->sb_head + need > sb->sb_size)) {
+		memmove(sb->sb_buf, sb->sb_buf + sb->sb_head, used);
+		sb->sb_head = 0;
+		sb->sb_tail = used;
+	}
+
+	if (need <= sb->sb_size && sb->sb_tail < sb->sb_size)
+		return;
+
+	for (newsize = sb->sb_size; newsize < need || newsize <= used;
+	    newsize *= 2)
+		;
+	newbuf = realloc(sb->sb_buf, newsize);
+	if (newbuf == NULL)
+		errx(-11, "make_room(): can't grow to %lu bytes", newsize);
+	sb->sb_buf = newbuf;
+	sb->sb_size = newsize;
+}
+
+static void
+reset_buf(svp_buf_t *sb)
+{
+	sb->sb_head = sb->sb_tail = 0;
+}
+
+static const char *
+conn_name(svp_conn_t *sc)
+{
+	static char buf[INET_ADDRSTRLEN + sizeof (":65535")];
+
+	(void) snprintf(buf, sizeof (buf), "%s:%u",
+	    inet_ntoa(sc->sc_addr.sin_addr), ntohs(sc->sc_addr.sin_port));
+	return (buf);
+}
+
+/*
+ * Tear the connection down, for reason "why", and schedule the next
+ * attempt.  If it was carrying transactions, svp.c parks them until we're
+ * back.  Safe to call from anywhere, including from inside
+ * handle_svp_frame(); the receive buffer's memory stays valid.
+ */
+void
+reset_svp_conn(svp_conn_t *sc, const char *why)
+{
+	uint64_t delay;
+
+	if (sc->sc_state == SVP_CS_DOWN)
+		return;
+
+	sc->sc_resets++;
+	if (sc->sc_fd != -1)
+		(void) close(sc->sc_fd);
+	sc->sc_fd = -1;
+	sc->sc_state = SVP_CS_DOWN;
+	reset_buf(&sc->sc_in);
+	reset_buf(&sc->sc_out);
+	sc->sc_fails = 0;
+	cancel_timer(&sc->sc_ka_timer);
+	(void) memset(sc->sc_ka_sent_us, 0, sizeof (sc->sc_ka_sent_us));
+	sc->sc_srtt_us = 0;	/* Could be a different server next time. */
+	sc->sc_min_rtt_us = 0;
+
+	delay = jitter_ms(sc->sc_backoff_ms);
+	sc->sc_backoff_ms *= 2;
+	if (sc->sc_backoff_ms > SVP_BACKOFF_MAX_MS)
+		sc->sc_backoff_ms = SVP_BACKOFF_MAX_MS;
+	warnx("SVP connection to %s: %s, retrying in %lu ms", conn_name(sc),
+	    why, delay);
+	arm_timer(&sc->sc_timer, delay);
+
+	/* Now it's DOWN, move what it was carrying elsewhere. */
+	if (sc->sc_outstanding != 0)
+		reroute_transactions(sc);
+}
+
+/* Reserve room for a frame at the end of sc_out, regardless of state. */
+static void *
+reserve_frame(svp_conn_t *sc, size_t len)
+{
+	svp_buf_t *sb = &sc->sc_out;
+	size_t used, newsize;
+	uint8_t *newbuf, *frame;
+
+	if (sb->sb_tail + len > sb->sb_size) {
+		used = sb->sb_tail - sb->sb_head;
+		if (sb->sb_head != 0) {
+			memmove(sb->sb_buf, sb->sb_buf + sb->sb_head, used);
+			sb->sb_head = 0;
+			sb->sb_tail = used;
+		}
+		if (used + len > sb->sb_size) {
+			for (newsize = sb->sb_size; newsize < used + len;
+			    newsize *= 2)
+				;
+			if (newsize > SVP_OUTBUF_MAX) {
+				sc->sc_out_full++;
+				return (NULL);
+			}
+			newbuf = realloc(sb->sb_buf, newsize);
+			if (newbuf == NULL) {
+				errx(-11, "reserve_frame(): can't grow to "
+				    "%lu bytes", newsize);
+			}
+			sb->sb_buf = newbuf;
+			sb->sb_size = newsize;
+		}
+	}
+
+	frame = sb->sb_buf + sb->sb_tail;
+	sb->sb_tail += len;
+	sc->sc_frames_out++;
+	return (frame);
+}
+
+static void
+encode_ping(svp_req_t *svp, uint32_t id)
+{
+	svp->svp_ver = htons(SVP_CURRENT_VERSION);
+	svp->svp_op = htons(SVP_R_PING);
+	svp->svp_size = 0;
+	svp->svp_id = id;
+	svp->svp_crc32 = 0;
+	svp->svp_crc32 = htonl(svp_crc(svp, sizeof (*svp)));
+}
+
+/* Connected; queue the PING.  parse_frames() will look for the PONG. */
+static void
+start_handshake(svp_conn_t *sc)
+{
+	svp_req_t *svp;
+
+	sc->sc_state = SVP_CS_HANDSHAKE;
+	svp = reserve_frame(sc, sizeof (*svp));
+	assert(svp != NULL);	/* Buffer was just emptied. */
+	encode_ping(svp, SVP_PING_ID);
+
+	arm_timer(&sc->sc_timer, SVP_CONNECT_TIMEOUT_MS);
+	flush_svp_conn(sc);
+}
+
+static void
+start_connect(svp_conn_t *sc)
+{
+	assert(sc->sc_state == SVP_CS_DOWN && sc->sc_fd == -1);
+
+	/* Open a TCP connection to Triton's "Portolan" SVP service. */
+	sc->sc_connects++;
+	sc->sc_state = SVP_CS_CONNECTING;
+	sc->sc_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sc->sc_fd == -1) {
+		reset_svp_conn(sc, strerror(errno));
+		return;
+	}
+
+	if (connect(sc->sc_fd, (struct sockaddr *)&sc->sc_addr,
+	    sizeof (sc->sc_addr)) == 0) {
+		start_handshake(sc);
+		return;
+	}
+	if (errno != EINPROGRESS) {
+		reset_svp_conn(sc, strerror(errno));
+		return;
+	}
+	arm_timer(&sc->sc_timer, SVP_CONNECT_TIMEOUT_MS);
+}
+
+/* poll() says our in-progress connect() has finished, one way or another. */
+static void
+finish_connect(svp_conn_t *sc)
+{
+	int error = 0;
+	socklen_t len = sizeof (error);
+
+	if (getsockopt(sc->sc_fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+		error = errno;
+	if (error != 0) {
+		reset_svp_conn(sc, strerror(error));
+		return;
+	}
+	start_handshake(sc);
+}
+
+static void
+conn_up(svp_conn_t *sc)
+{
+	cancel_timer(&sc->sc_timer);
+	sc->sc_state = SVP_CS_UP;
+	sc->sc_backoff_ms = SVP_BACKOFF_MIN_MS;
+	warnx("SVP connection to %s is up", conn_name(sc));
+	sc->sc_ka_next = 0;
+	arm_timer(&sc->sc_ka_timer, SVP_KA_INTERVAL_MS);
+	replay_transactions();
+	resume_svp_bulk();
+	resume_svp_log();
+}
+
+static void
+conn_timeout(void *arg)
+{
+	svp_conn_t *sc = arg;
+
+	switch (sc->sc_state) {
+	case SVP_CS_DOWN:
+		start_connect(sc);
+		break;
+	case SVP_CS_CONNECTING:
+		reset_svp_conn(sc, "connect() timed out");
+		break;
+	case SVP_CS_HANDSHAKE:
+		reset_svp_conn(sc, "no PONG");
+		break;
+	default:
+		assert(sc->sc_state == SVP_CS_UP);
+		break;
+	}
+}
+
+/* Time for a keepalive on "sc"; see SVP_KA_INTERVAL_MS. */
+static void
+conn_keepalive(void *arg)
+{
+	svp_conn_t *sc = arg;
+	svp_req_t *svp;
+	uint32_t i, slot, out = 0;
+
+	assert(sc->sc_state == SVP_CS_UP);
+	for (i = 0; i < SVP_KA_SLOTS; i++) {
+		if (sc->sc_ka_sent_us[i] != 0)
+			out++;
+	}
+	if (out >= SVP_KA_MISSES) {
+		sc->sc_ka_deaths++;
+		reset_svp_conn(sc, "keepalives unanswered");
+		return;
+	}
+	arm_timer(&sc->sc_ka_timer, SVP_KA_INTERVAL_MS);
+
+	/* There's a free slot, since out < SVP_KA_MISSES < SVP_KA_SLOTS. */
+	for (slot = sc->sc_ka_next; sc->sc_ka_sent_us[slot] != 0;
+	    slot = (slot + 1) % SVP_KA_SLOTS)
+		;
+	svp = append_svp_frame(sc, sizeof (*svp));
+	if (svp == NULL)
+		return;		/* Lookups will notice a stuck server. */
+	encode_ping(svp, SVP_ID_RESERVED + slot);
+	sc->sc_ka_sent_us[slot] = now_us();
+	sc->sc_ka_next = (slot + 1) % SVP_KA_SLOTS;
+	sc->sc_ka_sent++;
+}
+
+/*
+ * Start connecting to Portolan at "svp_sin".  This never fails; if the
+ * server isn't there the connection just keeps retrying in the background.
+ */
+static svp_conn_t *
+new_svp(struct sockaddr_in *svp_sin)
+{
+	svp_conn_t *sc;
+
+	sc = calloc(1, sizeof (*sc));
+	if (sc == NULL)
+		errx(-11, "new_svp(): allocation failed");
+	sc->sc_fd = -1;
+	sc->sc_state = SVP_CS_DOWN;
+	sc->sc_addr = *svp_sin;
+	sc->sc_timer.vt_func = conn_timeout;
+	sc->sc_timer.vt_arg = sc;
+	sc->sc_ka_timer.vt_func = conn_keepalive;
+	sc->sc_ka_timer.vt_arg = sc;
+	sc->sc_backoff_ms = SVP_BACKOFF_MIN_MS;
+	sc->sc_limit = SVP_LIMIT_INITIAL;
+	init_buf(&sc->sc_in, SVP_INBUF_SIZE);
+	init_buf(&sc->sc_out, SVP_OUTBUF_SIZE);
+	start_connect(sc);
+	return (sc);
+}
+
+void
+add_svp_server(struct sockaddr_in *svp_sin)
+{
+	if (svp_npool == SVP_MAX_SERVERS)
+		errx(-3, "Too many SVP servers, max %u", SVP_MAX_SERVERS);
+	svp_pool[svp_npool++] = new_svp(svp_sin);
+}
+
+/*
+ * Choose where to send a new request: the UP, non-ejected server with the
+ * least expected wait, i.e. the fewest outstanding transactions weighted
+ * by its smoothed RTT.  If every UP server is ejected, we'd rather use a
+ * sick one than none, so fall back to scoring those.  Servers at their
+ * concurrency limit aren't considered at all.  NULL if nothing (other
+ * than "avoid", if non-NULL) is UP and has room.
+ */
+svp_conn_t *
+pick_svp_conn(const svp_conn_t *avoid)
+{
+	svp_conn_t *sc, *best = NULL;
+	uint64_t now = now_ms(), score, best_score = UINT64_MAX;
+	bool best_ejected = true, ejected;
+	uint32_t i;
+
+	for (i = 0; i < svp_npool; i++) {
+		sc = svp_pool[i];
+		if (sc->sc_state != SVP_CS_UP || sc == avoid ||
+		    sc->sc_outstanding >= sc->sc_limit)
+			continue;
+		ejected = now < sc->sc_eject_until;
+		if (ejected && !best_ejected)
+			continue;
+		score = (uint64_t)(sc->sc_outstanding + 1) *
+		    (sc->sc_srtt_us != 0 ? sc->sc_srtt_us : SVP_RTT_INITIAL_US);
+		if ((best_ejected && !ejected) || score < best_score) {
+			best = sc;
+			best_score = score;
+			best_ejected = ejected;
+		}
+	}
+	return (best);
+}
+
+static uint32_t
+hist_bucket(uint64_t us)
+{
+	uint32_t lg, b;
+
+	if (us < (1U << SVP_HIST_SUB))
+		return ((uint32_t)us);
+	lg = 63 - __builtin_clzll(us);
+	b = ((lg - SVP_HIST_SUB + 1) << SVP_HIST_SUB) |
+	    ((us >> (lg - SVP_HIST_SUB)) & ((1U << SVP_HIST_SUB) - 1));
+	return (b < SVP_HIST_BUCKETS ? b : SVP_HIST_BUCKETS - 1);
+}
+
+/* The largest value that lands in bucket "b". */
+static uint64_t
+hist_bucket_max(uint32_t b)
+{
+	uint32_t lg;
+
+	if (b < (1U << SVP_HIST_SUB))
+		return (b);
+	lg = (b >> SVP_HIST_SUB) + SVP_HIST_SUB - 1;
+	return ((((uint64_t)(b & ((1U << SVP_HIST_SUB) - 1)) + 1 +
+	    (1U << SVP_HIST_SUB)) << (lg - SVP_HIST_SUB)) - 1);
+}
+
+static void
+hist_add(svp_hist_t *h, uint64_t us)
+{
+	uint32_t b;
+
+	h->sh_counts[hist_bucket(us)]++;
+	if (++h->sh_total >= SVP_HIST_DECAY) {
+		for (h->sh_total = 0, b = 0; b < SVP_HIST_BUCKETS; b++) {
+			h->sh_counts[b] /= 2;
+			h->sh_total += h->sh_counts[b];
+		}
+	}
+}
+
+/*
+ * The "pct"th percentile of "h", in microseconds, rounded up to its
+ * bucket's edge.  0 if we haven't seen enough samples to say.
+ */
+static uint64_t
+hist_percentile(const svp_hist_t *h, uint32_t pct)
+{
+	uint64_t need, seen = 0;
+	uint32_t b;
+
+	if (h->sh_total < SVP_HIST_MIN)
+		return (0);
+	need = ((uint64_t)h->sh_total * pct + 99) / 100;
+	for (b = 0; b < SVP_HIST_BUCKETS; b++) {
+		seen += h->sh_counts[b];
+		if (seen >= need)
+			break;
+	}
+	return (hist_bucket_max(b < SVP_HIST_BUCKETS ? b :
+	    SVP_HIST_BUCKETS - 1));
+}
+
+/* Of recent first-try lookup RTTs across the pool; see hist_percentile(). */
+uint64_t
+svp_rtt_percentile(uint32_t pct)
+{
+	return (hist_percentile(&rtt_hist, pct));
+}
+
+/* Congestion on "sc": multiplicative decrease, once per round trip. */
+static void
+cut_limit(svp_conn_t *sc)
+{
+	uint64_t now = now_us();
+
+	if (now - sc->sc_last_cut_us < sc->sc_srtt_us)
+		return;
+	sc->sc_last_cut_us = now;
+	sc->sc_limit -= sc->sc_limit / 10;
+	if (sc->sc_limit < SVP_LIMIT_MIN)
+		sc->sc_limit = SVP_LIMIT_MIN;
+	sc->sc_limit_acc = 0;
+	sc->sc_limit_cuts++;
+}
+
+/*
+ * An RTT sample from "sc", lookup or keepalive.  Fold it into the
+ * connection's histogram, and its smoothed RTT (which pick_svp_conn()
+ * balances on) with the usual 1/8 gain.
+ */
+static void
+record_rtt(svp_conn_t *sc, uint64_t us)
+{
+	hist_add(&sc->sc_rtt_hist, us);
+	if (sc->sc_srtt_us == 0)
+		sc->sc_srtt_us = us;
+	else
+		sc->sc_srtt_us = sc->sc_srtt_us - sc->sc_srtt_us / 8 + us / 8;
+}
+
+/*
+ * An unambiguous (first-try, per Karn) answer came back from "sc" after
+ * "us" microseconds.  Record it, and in the pool-wide histogram, adjust
+ * the concurrency limit, and consider the server healthy again.
+ */
+void
+note_svp_rtt(svp_conn_t *sc, uint64_t us)
+{
+	if (sc->sc_min_rtt_us == 0 || us < sc->sc_min_rtt_us ||
+	    ++sc->sc_min_rtt_age >= SVP_MINRTT_SAMPLES) {
+		sc->sc_min_rtt_us = us;
+		sc->sc_min_rtt_age = 0;
+	}
+	if (us > sc->sc_min_rtt_us * SVP_LIMIT_SLOW &&
+	    us > sc->sc_min_rtt_us + SVP_LIMIT_SLACK_US) {
+		cut_limit(sc);
+	} else if (++sc->sc_limit_acc >= sc->sc_limit) {
+		sc->sc_limit_acc = 0;
+		if (sc->sc_limit < SVP_LIMIT_MAX)
+			sc->sc_limit++;
+	}
+
+	hist_add(&rtt_hist, us);
+	record_rtt(sc, us);
+	sc->sc_fails = 0;
+	sc->sc_eject_ms = 0;
+}
+
+/*
+ * A request sent to "sc" went unanswered for its whole timeout.  Too many
+ * in a row and the server is ejected from pick_svp_conn()'s choices for a
+ * while, longer each time it happens again without an answer in between.
+ */
+void
+note_svp_timeout(svp_conn_t *sc)
+{
+	cut_limit(sc);
+
+	/* Stragglers from before it was ejected don't count again. */
+	if (now_ms() < sc->sc_eject_until)
+		return;
+	if (++sc->sc_fails < SVP_EJECT_FAILS)
+		return;
+
+	sc->sc_fails = 0;
+	if (sc->sc_eject_ms == 0)
+		sc->sc_eject_ms = SVP_EJECT_MIN_MS;
+	else if (sc->sc_eject_ms < SVP_EJECT_MAX_MS)
+		sc->sc_eject_ms *= 2;
+	sc->sc_eject_until = now_ms() + sc->sc_eject_ms;
+	sc->sc_ejections++;
+	warnx("SVP server %s not answering, ejected for %lu ms",
+	    conn_name(sc), sc->sc_eject_ms);
+}
+
+/*
+ * A PONG for keepalive slot svp_id - SVP_ID_RESERVED.  It doesn't count
+ * towards the concurrency limit or lift an ejection; a server can answer
+ * PINGs while its lookups are stuck.
+ */
+static void
+handle_pong(svp_conn_t *sc, svp_req_t *svp_req)
+{
+	uint32_t slot = svp_req->svp_id - SVP_ID_RESERVED;
+
+	if (svp_req->svp_id < SVP_ID_RESERVED || slot >= SVP_KA_SLOTS ||
+	    sc->sc_ka_sent_us[slot] == 0) {
+		sc->sc_ka_stray++;
+		return;
+	}
+	record_rtt(sc, now_us() - sc->sc_ka_sent_us[slot]);
+	sc->sc_ka_sent_us[slot] = 0;
+	sc->sc_ka_answered++;
+}
+
+/*
+ * Hand every complete frame in the receive buffer to handle_svp_frame(),
+ * in place.  A trailing partial frame stays put for next time.
+ */
+static void
+parse_frames(svp_conn_t *sc)
+{
+	svp_buf_t *sb = &sc->sc_in;
+	svp_req_t *svp_req;
+	size_t avail, framelen;
+	uint32_t crc_holder, crc_val;
+	char why[64];
+
+	while ((avail = sb->sb_tail - sb->sb_head) >= sizeof (svp_req_t)) {
+		/* x86-64 only; we don't care that this may be unaligned. */
+		svp_req = (svp_req_t *)(sb->sb_buf + sb->sb_head);
+		/*
+		 * Either way there's no finding the next frame boundary, so
+		 * start over on a fresh connection.
+		 */
+		if (svp_req->svp_ver != htons(SVP_CURRENT_VERSION)) {
+			(void) snprintf(why, sizeof (why), "SVP version "
+			    "mismatch: got %u, expected %u",
+			    ntohs(svp_req->svp_ver), SVP_CURRENT_VERSION);
+			reset_svp_conn(sc, why);
+			return;
+		}
+		framelen = sizeof (svp_req_t) + ntohl(svp_req->svp_size);
+		if (framelen > SVP_MAX_FRAME) {
+			(void) snprintf(why, sizeof (why), "frame of %lu bytes "
+			    "is more than %u", framelen, SVP_MAX_FRAME);
+			reset_svp_conn(sc, why);
+			return;
+		}
+		if (avail < framelen) {
+			/* Make sure the rest of it will fit when it comes. */
+			make_room(sb, framelen);
+			return;
+		}
+
+		crc_holder = ntohl(svp_req->svp_crc32);
+		svp_req->svp_crc32 = 0;
+		crc_val = svp_crc(svp_req, framelen);
+		sb->sb_head += framelen;
+		sc->sc_frames_in++;
+		if (crc_holder != crc_val) {
+			warnx("SVP crc mismatch on op 0x%x id 0x%x. Wire's == "
+			    "0x%x, Ours == 0x%x, dropping",
+			    ntohs(svp_req->svp_op), svp_req->svp_id,
+			    crc_holder, crc_val);
+			sc->sc_crc_errors++;
+			continue;
+		}
+
+		if (sc->sc_state == SVP_CS_HANDSHAKE) {
+			if (svp_req->svp_op != htons(SVP_R_PONG) ||
+			    svp_req->svp_id != SVP_PING_ID) {
+				reset_svp_conn(sc, "bad reply to PING");
+				return;
+			}
+			conn_up(sc);
+			continue;
+		}
+		if (svp_req->svp_op == htons(SVP_R_PONG)) {
+			handle_pong(sc, svp_req);
+			continue;
+		}
+
+		handle_svp_frame(sc, svp_req);
+		if (sc->sc_state != SVP_CS_UP)
+			return;		/* It reset the connection. */
+	}
+
+	if (sb->sb_head == sb->sb_tail)
+		sb->sb_head = sb->sb_tail = 0;
+}
+
+/*
+ * Drain the (non-blocking) socket, processing every complete frame as we
+ * go.  Called when poll() says there's something to read.  Whatever kernel
+ * updates the answers call for go out as one link batch per wakeup.
+ */
+static void
+handle_svp_inbound(svp_conn_t *sc)
+{
+	svp_buf_t *sb = &sc->sc_in;
+	ssize_t chunk;
+
+	begin_link_batch();
+	while (sc->sc_state == SVP_CS_HANDSHAKE || sc->sc_state == SVP_CS_UP) {
+		if (sb->sb_tail == sb->sb_size)
+			make_room(sb, 0);
+
+		chunk = recv(sc->sc_fd, sb->sb_buf + sb->sb_tail,
+		    sb->sb_size - sb->sb_tail, 0);
+		if (chunk == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			reset_svp_conn(sc, strerror(errno));
+			break;
+		}
+		if (chunk == 0) {
+			reset_svp_conn(sc, "closed by Portolan");
+			break;
+		}
+
+		sb->sb_tail += chunk;
+		sc->sc_bytes_in += chunk;
+		parse_frames(sc);
+	}
+	(void) end_link_batch();
+}
+
+/* What main() should poll() sc_fd for. */
+short
+svp_conn_events(svp_conn_t *sc)
+{
+	switch (sc->sc_state) {
+	case SVP_CS_DOWN:
+		return (0);
+	case SVP_CS_CONNECTING:
+		return (POLLOUT);
+	default:
+		/* Only ask about writability if a flush came up short. */
+		return (SVP_CONN_PENDING(sc) ? (POLLIN | POLLOUT) : POLLIN);
+	}
+}
+
+/*
+ * poll() returned "revents" for sc_fd.  Output is taken care of by the
+ * flush_svp_conn() at the bottom of the event loop.
+ */
+void
+handle_svp_events(svp_conn_t *sc, short revents)
+{
+	if (revents == 0)
+		return;
+	if (sc->sc_state == SVP_CS_CONNECTING)
+		finish_connect(sc);
+	else if ((revents & ~POLLOUT) != 0)
+		handle_svp_inbound(sc);
+}
+
+/*
+ * Reserve "len" bytes at the end of the send buffer for the caller to
+ * encode one frame into, in place.  The frame is committed as soon as this
+ * returns, so the caller must fill in all of it.  Returns NULL if the
+ * buffer is at its limit, or the connection isn't up.
+ *
+ * If enough is already queued, it's flushed first rather than waiting for
+ * the end of the loop (not after, the new frame isn't filled in yet).
+ */
+void *
+append_svp_frame(svp_conn_t *sc, size_t len)
+{
+	svp_buf_t *sb = &sc->sc_out;
+
+	if (sc->sc_state != SVP_CS_UP)
+		return (NULL);
+	if (sb->sb_tail - sb->sb_head >= SVP_FLUSH_BYTES) {
+		flush_svp_conn(sc);
+		if (sc->sc_state != SVP_CS_UP)
+			return (NULL);
+	}
+	return (reserve_frame(sc, len));
+}
+
+/*
+ * Write out as much of the send buffer as the socket will take.  Whatever
+ * doesn't go now stays queued, and main() will poll() for POLLOUT.
+ */
+void
+flush_svp_conn(svp_conn_t *sc)
+{
+	svp_buf_t *sb = &sc->sc_out;
+	ssize_t sent;
+
+	if (sc->sc_state != SVP_CS_HANDSHAKE && sc->sc_state != SVP_CS_UP)
+		return;
+
+	while (sb->sb_head != sb->sb_tail) {
+		sent = send(sc->sc_fd, sb->sb_buf + sb->sb_head,
+		    sb->sb_tail - sb->sb_head, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				sc->sc_short_sends++;
+				return;
+			}
+			reset_svp_conn(sc, strerror(errno));
+			return;
+		}
+		sc->sc_sends++;
+		sc->sc_bytes_out += sent;
+		sb->sb_head += sent;
+		if (sb->sb_head != sb->sb_tail)
+			sc->sc_short_sends++;
+	}
+	sb->sb_head = sb->sb_tail = 0;
+}
+
+static void
+dump_svp_conn_stats(svp_conn_t *sc)
+{
+	static const char *states[] = {
+		"down", "connecting", "handshaking", "up"
+	};
+	uint64_t now = now_ms();
+
+	warnx("SVP conn to %s: %s%s, %u outstanding, srtt %lu us, %lu "
+	    "ejections, %lu connects, %lu resets", conn_name(sc),
+	    states[sc->sc_state], now < sc->sc_eject_until ? " (ejected)" : "",
+	    sc->sc_outstanding, sc->sc_srtt_us, sc->sc_ejections,
+	    sc->sc_connects, sc->sc_resets);
+	warnx("SVP conn: limit %u (%lu cuts), min rtt %lu us", sc->sc_limit,
+	    sc->sc_limit_cuts, sc->sc_min_rtt_us);
+	warnx("SVP conn: rtt p50 %lu us, p90 %lu us, p99 %lu us",
+	    hist_percentile(&sc->sc_rtt_hist, 50),
+	    hist_percentile(&sc->sc_rtt_hist, 90),
+	    hist_percentile(&sc->sc_rtt_hist, 99));
+	warnx("SVP conn: %lu keepalives, %lu answered, %lu stray PONGs, "
+	    "%lu resets for no answer", sc->sc_ka_sent, sc->sc_ka_answered,
+	    sc->sc_ka_stray, sc->sc_ka_deaths);
+	warnx("SVP conn: in %lu frames/%lu bytes (%lu bad crc), out %lu "
+	    "frames/%lu bytes in %lu sends (%lu short), %lu refused, %lu "
+	    "queued", sc->sc_frames_in, sc->sc_bytes_in, sc->sc_crc_errors,
+	    sc->sc_frames_out, sc->sc_bytes_out, sc->sc_sends,
+	    sc->sc_short_sends, sc->sc_out_full,
+	    sc->sc_out.sb_tail - sc->sc_out.sb_head);
+}
+
+void
+dump_svp_pool_stats(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < svp_npool; i++)
+		dump_svp_conn_stats(svp_pool[i]);
+}
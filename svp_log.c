@@ -0,0 +1,401 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2023 MNX Cloud, Inc.
+ */
+
+/*
+ * Change-log sync.  Portolan keeps a log, per CN underlay address, of VL2
+ * and VL3 mappings that have changed (VM moves, removals).  We poll it
+ * with SVP_R_LOG_REQ, apply what comes back, and tell Portolan we're done
+ * with those entries with SVP_R_LOG_RM, as the illumos varpd does:
+ *
+ *	VL2 entry	Forget the MAC: drop it from the cache and the vxlan
+ *			FDB, so the next packet to it asks again.
+ *	VL3 entry	Forget the IP's neighbor entries on fabric links on
+ *			that VLAN, then look it up afresh, so the new answer
+ *			is programmed as soon as Portolan gives it.
+ *
+ * Entries are idempotent, so anything not LOG_RM'd (a lost ack, a
+ * connection reset) is simply applied again when it's redelivered.
+ *
+ * Polling adapts: when a LOG_REQ brought back entries, the next one goes
+ * out as soon as the LOG_RM is acked; each empty one doubles the interval,
+ * from SVP_LOG_MIN_MS up to SVP_LOG_MAX_MS.  Like svp_bulk.c, there's only
+ * ever one request outstanding, matched on lg_id.
+ */
+
+#include <err.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <netinet/in.h>
+
+#include "link.h"
+#include "svp.h"
+#include "timer.h"
+#include "cache.h"
+
+#define	SVP_LOG_MIN_MS		TIMER_TICK_MS
+#define	SVP_LOG_MAX_MS		2000
+#define	SVP_LOG_TIMEOUT_MS	(5 * 1000)
+#define	SVP_LOG_BYTES		(64 * 1024)	/* svlr_count we ask for */
+#define	SVP_LOG_MAX_LINKS	16	/* Fabric links per vnet/VLAN */
+#define	SVP_LOG_ID_LEN		16	/* svl[23]_id, a UUID */
+
+typedef enum svp_log_state {
+	SVP_LG_OFF = 0,		/* No -u, no log */
+	SVP_LG_IDLE,		/* Waiting to poll */
+	SVP_LG_REQ,		/* LOG_REQ outstanding */
+	SVP_LG_RM		/* LOG_RM outstanding */
+} svp_log_state_t;
+
+static void log_timer(void *);
+
+static svp_log_state_t lg_state;
+static uint8_t lg_uip[16];	/* Our underlay address, v4-mapped */
+static uint32_t lg_id;		/* Of the outstanding request */
+static svp_conn_t *lg_conn;	/* ...where it went */
+static uint64_t lg_conn_gen;	/* ...and that conn's sc_connects then */
+static uint64_t lg_interval_ms;	/* Current idle poll interval */
+static varpd_timer_t lg_timer = { .vt_func = log_timer };
+
+static uint64_t lg_polls, lg_empty, lg_timeouts, lg_bad;
+static uint64_t lg_vl2, lg_vl3, lg_foreign, lg_relookups, lg_removed;
+
+/* Poll again in "ms". */
+static void
+schedule_log(uint64_t ms)
+{
+	lg_state = SVP_LG_IDLE;
+	lg_conn = NULL;
+	arm_timer(&lg_timer, ms);
+}
+
+/* Nothing new; back off. */
+static void
+idle_log(void)
+{
+	lg_interval_ms *= 2;
+	if (lg_interval_ms > SVP_LOG_MAX_MS)
+		lg_interval_ms = SVP_LOG_MAX_MS;
+	schedule_log(lg_interval_ms);
+}
+
+void
+init_log_sync(const struct in_addr *uip)
+{
+	IN6_INADDR_TO_V4MAPPED(uip, (struct in6_addr *)lg_uip);
+	lg_interval_ms = SVP_LOG_MIN_MS;
+	schedule_log(SVP_LOG_MIN_MS);
+}
+
+static void
+send_log_req(void)
+{
+	svp_conn_t *sc = pick_svp_conn(NULL);
+	svp_req_t *svp;
+	svp_log_req_t *svlr;
+
+	svp = (sc == NULL) ? NULL :
+	    append_svp_frame(sc, sizeof (*svp) + sizeof (*svlr));
+	if (svp == NULL) {
+		schedule_log(SVP_LOG_MAX_MS);
+		return;
+	}
+	svlr = (svp_log_req_t *)(svp + 1);
+
+	lg_state = SVP_LG_REQ;
+	lg_id = new_svp_id();
+	lg_conn = sc;
+	lg_conn_gen = sc->sc_connects;
+	lg_polls++;
+
+	svp->svp_ver = htons(SVP_CURRENT_VERSION);
+	svp->svp_op = htons(SVP_R_LOG_REQ);
+	svp->svp_size = htonl(sizeof (*svlr));
+	svp->svp_id = lg_id;
+	svp->svp_crc32 = 0;
+	svlr->svlr_count = htonl(SVP_LOG_BYTES);
+	memcpy(svlr->svlr_ip, lg_uip, sizeof (svlr->svlr_ip));
+	svp->svp_crc32 = htonl(svp_crc(svp, sizeof (*svp) + sizeof (*svlr)));
+
+	arm_timer(&lg_timer, SVP_LOG_TIMEOUT_MS);
+}
+
+static void
+log_timer(void *arg)
+{
+	if (lg_state != SVP_LG_IDLE) {
+		/* Whatever we didn't LOG_RM will be sent to us again. */
+		lg_timeouts++;
+		warnx("SVP log %s timed out",
+		    lg_state == SVP_LG_REQ ? "request" : "removal");
+	}
+	send_log_req();
+}
+
+/*
+ * A connection came up.  If the outstanding request went down with an
+ * earlier one, start over now rather than at the timeout.
+ */
+void
+resume_svp_log(void)
+{
+	if (lg_state != SVP_LG_REQ && lg_state != SVP_LG_RM)
+		return;
+	if (lg_conn->sc_state != SVP_CS_UP ||
+	    lg_conn->sc_connects != lg_conn_gen)
+		send_log_req();
+}
+
+static void
+apply_log_vl2(const svp_log_vl2_t *svl2)
+{
+	uint32_t vnetid = ntohl(svl2->svl2_vnetid);
+	fabric_link_t *vxlan = vnet_to_link(vnetid);
+	svp_lookup_key_t key;
+
+	if (vxlan == NULL) {
+		lg_foreign++;
+		return;
+	}
+	lg_vl2++;
+
+	memset(&key, 0, sizeof (key));
+	key.slk_vnetid = vnetid;
+	key.slk_af = AF_PACKET;
+	memcpy(key.slk_addr, svl2->svl2_mac, ETHERADDRL);
+	remove_negative(&key);
+	remove_vl2_mapping(vnetid, svl2->svl2_mac);
+	unprogram_vl2(vxlan, svl2->svl2_mac);
+}
+
+/*
+ * Returns how many fabric links the VL3 entry's neighbor was removed from;
+ * the caller looks it up again on each once the batch is applied.
+ */
+static uint32_t
+apply_log_vl3(const svp_log_vl3_t *svl3, fabric_link_t **links)
+{
+	uint32_t vnetid = ntohl(svl3->svl3_vnetid), nlinks, i;
+	svp_lookup_key_t key;
+	bool v4;
+
+	if (vnet_to_link(vnetid) == NULL) {
+		lg_foreign++;
+		return (0);
+	}
+	lg_vl3++;
+
+	v4 = IN6_IS_ADDR_V4MAPPED((struct in6_addr *)svl3->svl3_ip);
+	memset(&key, 0, sizeof (key));
+	key.slk_vnetid = vnetid;
+	key.slk_af = v4 ? AF_INET : AF_INET6;
+	memcpy(key.slk_addr, svl3->svl3_ip, sizeof (key.slk_addr));
+	remove_negative(&key);
+	remove_vl3_mapping(vnetid, svl3->svl3_ip);
+
+	nlinks = find_fabric_links(vnetid, ntohs(svl3->svl3_vlan), links,
+	    SVP_LOG_MAX_LINKS);
+	for (i = 0; i < nlinks; i++)
+		unprogram_vl3(links[i], svl3->svl3_ip);
+	return (nlinks);
+}
+
+/* Size of the log entry at "p", or 0 if it's unknown or truncated. */
+static size_t
+log_entry_size(const uint8_t *p, size_t left)
+{
+	uint32_t type;
+	size_t need;
+
+	if (left < sizeof (type))
+		return (0);
+	memcpy(&type, p, sizeof (type));
+	switch (ntohl(type)) {
+	case SVP_LOG_VL2:
+		need = sizeof (svp_log_vl2_t);
+		break;
+	case SVP_LOG_VL3:
+		need = sizeof (svp_log_vl3_t);
+		break;
+	default:
+		return (0);
+	}
+	return (need <= left ? need : 0);
+}
+
+/*
+ * Apply a LOG_ACK's entries, in one kernel batch, then LOG_RM them all.
+ * Entries are decoded in place; a bad one ends the walk, and only what
+ * came before it is removed.
+ */
+static void
+apply_log(svp_conn_t *sc, const uint8_t *data, size_t len)
+{
+	fabric_link_t *links[SVP_LOG_MAX_LINKS];
+	const uint8_t *p;
+	uint8_t *ids;
+	svp_req_t *svp;
+	svp_lrm_req_t *svrr;
+	uint32_t count = 0, nlinks, i;
+	size_t off, sz, rmlen;
+
+	if (len == 0) {
+		idle_log();
+		return;
+	}
+
+	begin_link_batch();
+	for (off = 0; (sz = log_entry_size(data + off, len - off)) != 0;
+	    off += sz) {
+		p = data + off;
+		if (sz == sizeof (svp_log_vl2_t)) {
+			apply_log_vl2((const svp_log_vl2_t *)p);
+		} else {
+			nlinks = apply_log_vl3((const svp_log_vl3_t *)p,
+			    links);
+			lg_removed += nlinks;
+		}
+		count++;
+	}
+	(void) end_link_batch();
+	if (off != len) {
+		lg_bad++;
+		warnx("SVP log: %lu bytes of bad or unknown entries skipped",
+		    len - off);
+	}
+
+	/*
+	 * Now the stale neighbors are gone, ask about them again.  Done as a
+	 * second pass so the answers can't race the removals above.
+	 */
+	for (off = 0; (sz = log_entry_size(data + off, len - off)) != 0;
+	    off += sz) {
+		const svp_log_vl3_t *svl3 = (const svp_log_vl3_t *)(data + off);
+		uint8_t af;
+
+		if (sz != sizeof (svp_log_vl3_t))
+			continue;
+		af = IN6_IS_ADDR_V4MAPPED((struct in6_addr *)svl3->svl3_ip) ?
+		    AF_INET : AF_INET6;
+		nlinks = find_fabric_links(ntohl(svl3->svl3_vnetid),
+		    ntohs(svl3->svl3_vlan), links, SVP_LOG_MAX_LINKS);
+		for (i = 0; i < nlinks; i++) {
+			send_l3_req(links[i]->fl_ifindex, af,
+			    (uint8_t *)svl3->svl3_ip);
+			lg_relookups++;
+		}
+	}
+
+	if (count == 0) {
+		idle_log();
+		return;
+	}
+
+	rmlen = sizeof (*svrr) + (size_t)count * SVP_LOG_ID_LEN;
+	svp = append_svp_frame(sc, sizeof (*svp) + rmlen);
+	if (svp == NULL) {
+		/* They'll come around again. */
+		schedule_log(SVP_LOG_MIN_MS);
+		return;
+	}
+	svrr = (svp_lrm_req_t *)(svp + 1);
+	ids = svrr->svrr_ids;
+	for (off = 0; (sz = log_entry_size(data + off, len - off)) != 0;
+	    off += sz) {
+		/* svl2_id and svl3_id are both right after the type. */
+		memcpy(ids, data + off + sizeof (uint32_t), SVP_LOG_ID_LEN);
+		ids += SVP_LOG_ID_LEN;
+	}
+
+	lg_state = SVP_LG_RM;
+	lg_id = new_svp_id();
+	lg_conn = sc;
+	lg_conn_gen = sc->sc_connects;
+
+	svp->svp_ver = htons(SVP_CURRENT_VERSION);
+	svp->svp_op = htons(SVP_R_LOG_RM);
+	svp->svp_size = htonl(rmlen);
+	svp->svp_id = lg_id;
+	svp->svp_crc32 = 0;
+	svrr->svrr_count = htonl(count);
+	svp->svp_crc32 = htonl(svp_crc(svp, sizeof (*svp) + rmlen));
+
+	arm_timer(&lg_timer, SVP_LOG_TIMEOUT_MS);
+}
+
+/*
+ * An SVP_R_LOG_ACK or SVP_R_LOG_RM_ACK arrived on "sc", complete and
+ * CRC-checked, in place in its receive buffer.
+ */
+void
+handle_log_ack(svp_conn_t *sc, svp_req_t *svp_req)
+{
+	size_t len = ntohl(svp_req->svp_size);
+	uint16_t op = ntohs(svp_req->svp_op);
+	uint32_t status;
+
+	if (svp_req->svp_id != lg_id ||
+	    (op == SVP_R_LOG_ACK && lg_state != SVP_LG_REQ) ||
+	    (op == SVP_R_LOG_RM_ACK && lg_state != SVP_LG_RM)) {
+		warnx("Ignoring stale SVP log ack 0x%x", svp_req->svp_id);
+		return;
+	}
+	if (len < sizeof (status)) {
+		warnx("handle_log_ack(): short ack (%lu bytes)", len);
+		idle_log();
+		return;
+	}
+	memcpy(&status, svp_req + 1, sizeof (status));
+	status = ntohl(status);
+
+	switch (status) {
+	case SVP_S_OK:
+		break;
+	case SVP_S_NOTFOUND:
+		/* An empty log. */
+		lg_empty++;
+		idle_log();
+		return;
+	case SVP_S_FATAL:
+		/* resume_svp_log() starts over once we've reconnected. */
+		reset_svp_conn(sc, "server returned SVP_S_FATAL");
+		return;
+	default:
+		warnx("handle_log_ack(): bad status 0x%x", status);
+		idle_log();
+		return;
+	}
+
+	if (op == SVP_R_LOG_RM_ACK) {
+		/* Changes are flowing; go straight back for more. */
+		lg_interval_ms = SVP_LOG_MIN_MS;
+		send_log_req();
+		return;
+	}
+
+	if (len == sizeof (svp_log_ack_t))
+		lg_empty++;
+	apply_log(sc, (uint8_t *)(svp_req + 1) + sizeof (svp_log_ack_t),
+	    len - sizeof (svp_log_ack_t));
+}
+
+void
+dump_svp_log_stats(void)
+{
+	static const char *states[] = { "off", "idle", "requesting",
+	    "removing" };
+
+	warnx("SVP log: %s, polling every %lu ms when idle, %lu polls, %lu "
+	    "empty, %lu timed out, %lu malformed", states[lg_state],
+	    lg_interval_ms, lg_polls, lg_empty, lg_timeouts, lg_bad);
+	warnx("SVP log: %lu VL2 and %lu VL3 changes applied, %lu for other "
+	    "vnets, %lu neighbors removed, %lu re-looked-up", lg_vl2, lg_vl3,
+	    lg_foreign, lg_removed, lg_relookups);
+}
@@ -0,0 +1,224 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2023 MNX Cloud, Inc.
+ */
+
+/*
+ * A hierarchical timer wheel, in the style of the classic BSD/Linux
+ * callout wheels.  Four levels of 64 slots each, TIMER_TICK_MS per
+ * level-0 slot, covers 2^24 ticks (~46 hours at 10ms).  Arming and
+ * cancelling are O(1) list operations; timers in the upper levels are
+ * cascaded down one level each time the level below wraps.
+ *
+ * Everything is driven from main()'s poll() loop: next_timer_timeout()
+ * supplies the poll() timeout, and run_timers() fires whatever is due.
+ */
+
+#include <time.h>
+#include <err.h>
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "timer.h"
+
+#define	TW_BITS		6
+#define	TW_SLOTS	(1 << TW_BITS)
+#define	TW_MASK		(TW_SLOTS - 1)
+#define	TW_LEVELS	4
+#define	TW_MAXTICKS	((1ULL << (TW_BITS * TW_LEVELS)) - 1)
+
+static varpd_timer_t *wheel[TW_LEVELS][TW_SLOTS];
+static uint64_t wheel_tick;	/* Next tick to be processed. */
+static uint32_t wheel_armed;	/* Count of armed timers. */
+
+uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(-50, "clock_gettime(CLOCK_MONOTONIC)");
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Same clock, finer grain, for RTT measurement. */
+uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(-50, "clock_gettime(CLOCK_MONOTONIC)");
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * Spread "ms" uniformly over [0.75 * ms, 1.25 * ms] so that timers armed
+ * together (e.g. a burst of retries) don't all fire together.
+ */
+uint64_t
+jitter_ms(uint64_t ms)
+{
+	return (ms - ms / 4 + (uint64_t)random() % (ms / 2 + 1));
+}
+
+void
+init_timers(void)
+{
+	wheel_tick = now_ms() / TIMER_TICK_MS;
+}
+
+static void
+slot_insert(varpd_timer_t **slot, varpd_timer_t *vt)
+{
+	vt->vt_next = *slot;
+	if (vt->vt_next != NULL)
+		vt->vt_next->vt_ptpn = &vt->vt_next;
+	vt->vt_ptpn = slot;
+	*slot = vt;
+}
+
+static void
+slot_remove(varpd_timer_t *vt)
+{
+	*(vt->vt_ptpn) = vt->vt_next;
+	if (vt->vt_next != NULL)
+		vt->vt_next->vt_ptpn = vt->vt_ptpn;
+	vt->vt_next = NULL;
+	vt->vt_ptpn = NULL;
+}
+
+/* Place a timer whose expiry tick is no earlier than "mintick". */
+static void
+place_timer(varpd_timer_t *vt, uint64_t mintick)
+{
+	uint64_t tick = (vt->vt_expire + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	uint64_t delta;
+	int level;
+
+	if (tick < mintick)
+		tick = mintick;
+	delta = tick - wheel_tick;
+	if (delta > TW_MAXTICKS) {
+		delta = TW_MAXTICKS;
+		tick = wheel_tick + delta;
+	}
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < (1ULL << (TW_BITS * (level + 1))))
+			break;
+	}
+	slot_insert(&wheel[level][(tick >> (TW_BITS * level)) & TW_MASK], vt);
+}
+
+/*
+ * Arm (or re-arm) "vt" to fire "ms" milliseconds from now.
+ */
+void
+arm_timer(varpd_timer_t *vt, uint64_t ms)
+{
+	assert(vt->vt_func != NULL);
+
+	if (timer_armed(vt))
+		cancel_timer(vt);
+	vt->vt_expire = now_ms() + ms;
+	/* Never into the slot being (or just) processed. */
+	place_timer(vt, wheel_tick + 1);
+	wheel_armed++;
+}
+
+void
+cancel_timer(varpd_timer_t *vt)
+{
+	if (!timer_armed(vt))
+		return;
+	slot_remove(vt);
+	assert(wheel_armed > 0);
+	wheel_armed--;
+}
+
+/* Move everything in wheel[level][index] down towards level 0. */
+static void
+cascade(int level, int index)
+{
+	varpd_timer_t *vt, *list = wheel[level][index];
+
+	wheel[level][index] = NULL;
+	while ((vt = list) != NULL) {
+		list = vt->vt_next;
+		vt->vt_next = NULL;
+		place_timer(vt, wheel_tick);
+	}
+}
+
+/*
+ * Milliseconds until the wheel next needs attention, suitable for poll().
+ * -1 (block forever) if nothing is armed.
+ */
+int
+next_timer_timeout(void)
+{
+	uint64_t now, when, k;
+
+	if (wheel_armed == 0)
+		return (-1);
+
+	/* Next (or pending) cascade point is the latest we can sleep to. */
+	when = (wheel_tick + TW_MASK) & ~(uint64_t)TW_MASK;
+	for (k = 0; k < TW_SLOTS && wheel_tick + k < when; k++) {
+		if (wheel[0][(wheel_tick + k) & TW_MASK] != NULL) {
+			when = wheel_tick + k;
+			break;
+		}
+	}
+
+	when *= TIMER_TICK_MS;
+	now = now_ms();
+	if (when <= now)
+		return (0);
+	return ((int)(when - now));
+}
+
+void
+run_timers(void)
+{
+	uint64_t target = now_ms() / TIMER_TICK_MS;
+	varpd_timer_t *vt, *list;
+	int index, level;
+
+	if (wheel_armed == 0) {
+		/* Nothing to cascade or fire, just catch up. */
+		if (target >= wheel_tick)
+			wheel_tick = target + 1;
+		return;
+	}
+
+	while (wheel_tick <= target) {
+		index = wheel_tick & TW_MASK;
+		for (level = 1; index == 0 && level < TW_LEVELS; level++) {
+			index = (wheel_tick >> (TW_BITS * level)) & TW_MASK;
+			cascade(level, index);
+		}
+
+		/*
+		 * Detach the slot onto a local list first, so callbacks can
+		 * re-arm themselves or cancel siblings safely.
+		 */
+		list = wheel[0][wheel_tick & TW_MASK];
+		wheel[0][wheel_tick & TW_MASK] = NULL;
+		if (list != NULL)
+			list->vt_ptpn = &list;
+		while ((vt = list) != NULL) {
+			slot_remove(vt);
+			wheel_armed--;
+			vt->vt_func(vt->vt_arg);
+		}
+		wheel_tick++;
+	}
+}
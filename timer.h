@@ -0,0 +1,55 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2023 MNX Cloud, Inc.
+ */
+
+#ifndef _TIMER_H
+#define	_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Embed one of these in whatever needs a timeout.  Callers fill in
+ * vt_func/vt_arg, the rest is owned by timer.c.
+ */
+typedef struct varpd_timer {
+	struct varpd_timer *vt_next;	/* Slot linkage */
+	struct varpd_timer **vt_ptpn;	/* NULL if not armed. */
+	uint64_t vt_expire;		/* Absolute, in now_ms() units. */
+	void (*vt_func)(void *);
+	void *vt_arg;
+} varpd_timer_t;
+
+#define	TIMER_TICK_MS	10	/* Wheel resolution. */
+
+extern uint64_t now_ms(void);
+extern uint64_t now_us(void);
+extern uint64_t jitter_ms(uint64_t);
+extern void init_timers(void);
+extern void arm_timer(varpd_timer_t *, uint64_t);
+extern void cancel_timer(varpd_timer_t *);
+extern int next_timer_timeout(void);
+extern void run_timers(void);
+
+static inline bool
+timer_armed(const varpd_timer_t *vt)
+{
+	return (vt->vt_ptpn != NULL);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TIMER_H */